@@ -44,7 +44,7 @@ const char *cpp_list = "c4s_builder.cpp c4s_logger.cpp c4s_path.cpp c4s_path_lis
     "c4s_process.cpp c4s_program_arguments.cpp c4s_util.cpp c4s_variables.cpp c4s_exception.cpp "\
     "c4s_settings.cpp";
 const char *cpp_win = "c4s_builder_vc.cpp c4s_builder_ml.cpp";
-const char *cpp_linux = "c4s_user.cpp c4s_builder_gcc.cpp";
+const char *cpp_linux = "c4s_user.cpp c4s_builder_gcc.cpp c4s_capture.cpp c4s_process_group.cpp c4s_pipeline.cpp c4s_process_reactor.cpp c4s_process_cache.cpp c4s_fork_server.cpp";
 
 // ==========================================================================================
 int documentation(ostream *log)
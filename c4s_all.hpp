@@ -39,11 +39,30 @@ Copyright (c) Menacon Oy
  #include <stdio.h>
  #include <syslog.h>
  #include <poll.h>
+ #include <spawn.h>
+ #include <sys/resource.h>
+ #include <sys/uio.h>
+ #include <thread>
+ #include <mutex>
+ #include <condition_variable>
+ #include <memory>
+ #include <atomic>
+ #include <sys/mman.h>
 // OSX Only?
  #include <signal.h>
  #ifdef __APPLE__
   #include <mach-o/dyld.h>
  #endif
+ #ifdef __linux
+  #include <sys/syscall.h>
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+  #include <sys/socket.h>
+  #include <sys/ioctl.h>
+  #include <sys/sendfile.h>
+  #include <sys/sysmacros.h>
+  #include <sched.h>
+ #endif
 #endif
 #ifdef _MSC_VER
  #include <direct.h>
@@ -63,7 +82,19 @@ Copyright (c) Menacon Oy
 #include "c4s_path.cpp"
 #include "c4s_path_list.cpp"
 #include "c4s_variables.cpp"
+#if defined(__linux) || defined(__APPLE__)
+  #include "c4s_capture.cpp"
+#endif
 #include "c4s_process.cpp"
+#if defined(__linux) || defined(__APPLE__)
+  #include "c4s_process_group.cpp"
+  #include "c4s_pipeline.cpp"
+  #include "c4s_process_cache.cpp"
+#endif
+#ifdef __linux
+  #include "c4s_process_reactor.cpp"
+  #include "c4s_fork_server.cpp"
+#endif
 #include "c4s_program_arguments.cpp"
 #include "c4s_logger.cpp"
 #include "c4s_util.cpp"
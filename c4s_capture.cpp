@@ -0,0 +1,370 @@
+/*******************************************************************************
+c4s_capture.cpp
+Implementation for capture_buffer-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifdef C4S_LIB_BUILD
+ #include <string.h>
+ #include <iostream>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <stdlib.h>
+ #include <sys/mman.h>
+ #include "c4s_config.hpp"
+ #include "c4s_exception.hpp"
+ #include "c4s_capture.hpp"
+ using namespace c4s;
+#endif
+
+string c4s::capture_buffer::spill_dir;
+
+// ==================================================================================================
+c4s::capture_buffer::capture_buffer(size_t cap)
+{
+    head = 0;
+    tail = 0;
+    mem_size = 0;
+    mem_cap = cap;
+    spill_fd = -1;
+    file_size = 0;
+    file_pos = 0;
+    map = 0;
+    map_len = 0;
+}
+
+// ==================================================================================================
+c4s::capture_buffer::~capture_buffer()
+{
+    release();
+    for(std::vector<char*>::iterator si=spare.begin(); si!=spare.end(); si++)
+        delete[] *si;
+    if(spill_fd>=0)
+        close(spill_fd);
+}
+
+// ==================================================================================================
+void c4s::capture_buffer::clear()
+{
+    if(!release())
+        throw c4s_exception("capture_buffer::clear - Unable to truncate the spill file.");
+}
+
+// ==================================================================================================
+bool c4s::capture_buffer::release()
+/*! Discards all data like clear but does not throw. Used by the destructor.
+  \retval bool False if the spill file could not be truncated.
+*/
+{
+    for(std::deque<char*>::iterator ci=chunks.begin(); ci!=chunks.end(); ci++)
+        delete[] *ci;
+    chunks.clear();
+    head = 0;
+    tail = 0;
+    mem_size = 0;
+    unmap();
+    bool ok = file_size==0 || ftruncate(spill_fd, 0) == 0;
+    file_size = 0;
+    file_pos = 0;
+    return ok;
+}
+
+// ==================================================================================================
+char* c4s::capture_buffer::space(size_t *len)
+/*! Returns free space at the end of memory. New chunk is taken into use if the last one is full and the
+  memory cap allows it.
+  \param len Set to the number of free bytes.
+  \retval char* Pointer to the free space or null if data must be spilled.
+*/
+{
+    if(file_size>0)
+        return 0;   // Keep the order: once spilled, everything goes to the file.
+    if(chunks.empty() || tail == CAPTURE_CHUNK) {
+        if(mem_size+CAPTURE_CHUNK > mem_cap && !chunks.empty())
+            return 0;
+        if(spare.empty())
+            chunks.push_back(new char[CAPTURE_CHUNK]);
+        else {
+            chunks.push_back(spare.back());
+            spare.pop_back();
+        }
+        tail = 0;
+    }
+    *len = CAPTURE_CHUNK - tail;
+    return chunks.back() + tail;
+}
+
+// ==================================================================================================
+void c4s::capture_buffer::append(const char *data, size_t len)
+{
+    size_t free_len;
+    while(len>0) {
+        char *dst = space(&free_len);
+        if(!dst) {
+            spill(data, len);
+            return;
+        }
+        if(free_len > len)
+            free_len = len;
+        memcpy(dst, data, free_len);
+        tail += free_len;
+        mem_size += free_len;
+        data += free_len;
+        len -= free_len;
+    }
+}
+
+// ==================================================================================================
+void c4s::capture_buffer::open_spill()
+/*! Creates the spill file unless it already exists.
+ */
+{
+    if(spill_fd>=0)
+        return;
+#ifdef __linux
+    if(spill_dir.empty()) {
+        spill_fd = memfd_create("c4s-capture", MFD_CLOEXEC);
+    }
+    else
+#endif
+    {
+        string name = spill_dir.empty() ? string("/tmp") : spill_dir;
+        name += "/c4s-captureXXXXXX";
+        spill_fd = mkstemp(&name[0]);
+        if(spill_fd>=0) {
+            unlink(name.c_str());
+            fcntl(spill_fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    if(spill_fd<0) {
+        ostringstream os;
+        os << "capture_buffer::open_spill - Unable to create spill file: "<<strerror(errno);
+        throw c4s_exception(os.str());
+    }
+}
+
+// ==================================================================================================
+void c4s::capture_buffer::spill(const char *data, size_t len)
+/*! Appends data to the end of the spill file.
+ */
+{
+    open_spill();
+    while(len>0) {
+        ssize_t bw = pwrite(spill_fd, data, len, file_size);
+        if(bw<0) {
+            if(errno == EINTR)
+                continue;
+            ostringstream os;
+            os << "capture_buffer::spill - Write error: "<<strerror(errno);
+            throw c4s_exception(os.str());
+        }
+        file_size += bw;
+        data += bw;
+        len -= bw;
+    }
+}
+
+// ==================================================================================================
+size_t c4s::capture_buffer::read_from(int &fd)
+/*! Data is read directly into the memory chunks. After the memory cap it is moved into the spill file,
+  on Linux with splice i.e. without copying through the user space.
+  \param fd Read end of the pipe. Set to zero at end of file.
+  \retval size_t Number of bytes read.
+*/
+{
+    size_t total=0, free_len;
+    ssize_t rsize;
+    while(fd) {
+        char *dst = space(&free_len);
+        if(!dst) {
+            total += spill_from(fd);
+            break;
+        }
+        rsize = read(fd, dst, free_len);
+        if(rsize>0) {
+            tail += rsize;
+            mem_size += rsize;
+            total += rsize;
+            continue;
+        }
+        if(rsize<0 && errno==EINTR)
+            continue;
+        if(rsize==0 || (errno!=EAGAIN && errno!=EWOULDBLOCK)) {
+            close(fd);
+            fd = 0;
+        }
+        break;
+    }
+    return total;
+}
+
+// ==================================================================================================
+size_t c4s::capture_buffer::spill_from(int &fd)
+{
+    char buffer[CAPTURE_CHUNK];
+    size_t total=0;
+    ssize_t rsize;
+    open_spill();
+    while(fd) {
+#ifdef __linux
+        loff_t off = file_size;
+        rsize = splice(fd, 0, spill_fd, &off, CAPTURE_CHUNK, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if(rsize>0) {
+            file_size += rsize;
+            total += rsize;
+            continue;
+        }
+        if(rsize<0 && errno==EINVAL)
+#endif
+        {
+            rsize = read(fd, buffer, sizeof(buffer));
+            if(rsize>0) {
+                spill(buffer, rsize);
+                total += rsize;
+                continue;
+            }
+        }
+        if(rsize<0 && errno==EINTR)
+            continue;
+        if(rsize==0 || (errno!=EAGAIN && errno!=EWOULDBLOCK)) {
+            close(fd);
+            fd = 0;
+        }
+        break;
+    }
+    return total;
+}
+
+// ==================================================================================================
+size_t c4s::capture_buffer::peek(const char **data)
+/*! Pointer stays valid until the data is consumed or more data is added.
+  \param data Set to point to the first unconsumed byte.
+  \retval size_t Number of bytes in the block or zero if the buffer is empty.
+*/
+{
+    if(mem_size>0) {
+        *data = chunks.front() + head;
+        return (chunks.size()==1 ? tail : CAPTURE_CHUNK) - head;
+    }
+    if(file_pos == file_size) {
+        *data = 0;
+        return 0;
+    }
+    if(map_len != file_size) {
+        unmap();
+        void *ptr = mmap(0, file_size, PROT_READ, MAP_SHARED, spill_fd, 0);
+        if(ptr == MAP_FAILED) {
+            ostringstream os;
+            os << "capture_buffer::peek - Unable to map the spill file: "<<strerror(errno);
+            throw c4s_exception(os.str());
+        }
+        map = (char*)ptr;
+        map_len = file_size;
+    }
+    *data = map + file_pos;
+    return file_size - file_pos;
+}
+
+// ==================================================================================================
+void c4s::capture_buffer::consume(size_t len)
+{
+    while(len>0 && mem_size>0) {
+        size_t block = (chunks.size()==1 ? tail : CAPTURE_CHUNK) - head;
+        if(len < block) {
+            head += len;
+            mem_size -= len;
+            return;
+        }
+        len -= block;
+        mem_size -= block;
+        head = 0;
+        if(spare.size()<2)
+            spare.push_back(chunks.front());
+        else
+            delete[] chunks.front();
+        chunks.pop_front();
+        if(chunks.empty())
+            tail = 0;
+    }
+    if(len>0) {
+        file_pos += len<file_size-file_pos ? len : file_size-file_pos;
+        if(file_pos == file_size) {
+            // Everything has been consumed. Continue in memory.
+            clear();
+        }
+    }
+}
+
+// ==================================================================================================
+void c4s::capture_buffer::unmap()
+{
+    if(map) {
+        munmap(map, map_len);
+        map = 0;
+        map_len = 0;
+    }
+}
+
+// ==================================================================================================
+string c4s::capture_buffer::str()
+{
+    string result;
+    result.reserve(size());
+    for(size_t ndx=0; ndx<chunks.size(); ndx++) {
+        size_t start = ndx==0 ? head : 0;
+        size_t end = ndx+1==chunks.size() ? tail : CAPTURE_CHUNK;
+        result.append(chunks[ndx]+start, end-start);
+    }
+    if(file_pos < file_size) {
+        size_t pos = result.size();
+        result.resize(pos + file_size - file_pos);
+        size_t offset = file_pos;
+        while(offset < file_size) {
+            ssize_t br = pread(spill_fd, &result[pos], file_size-offset, offset);
+            if(br <= 0) {
+                if(br<0 && errno==EINTR)
+                    continue;
+                throw c4s_exception("capture_buffer::str - Unable to read the spill file.");
+            }
+            pos += br;
+            offset += br;
+        }
+    }
+    return result;
+}
+
+// ==================================================================================================
+void c4s::capture_buffer::write_to(ostream &os)
+{
+    char buffer[CAPTURE_CHUNK];
+    for(size_t ndx=0; ndx<chunks.size(); ndx++) {
+        size_t start = ndx==0 ? head : 0;
+        size_t end = ndx+1==chunks.size() ? tail : CAPTURE_CHUNK;
+        os.write(chunks[ndx]+start, end-start);
+    }
+    size_t offset = file_pos;
+    while(offset < file_size) {
+        ssize_t br = pread(spill_fd, buffer, sizeof(buffer), offset);
+        if(br <= 0) {
+            if(br<0 && errno==EINTR)
+                continue;
+            throw c4s_exception("capture_buffer::write_to - Unable to read the spill file.");
+        }
+        os.write(buffer, br);
+        offset += br;
+    }
+}
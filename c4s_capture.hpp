@@ -0,0 +1,98 @@
+/*******************************************************************************
+c4s_capture.hpp
+Defines capture_buffer-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifndef C4S_CAPTURE_HPP
+#define C4S_CAPTURE_HPP
+
+#include <deque>
+#include <vector>
+
+namespace c4s {
+
+    //! Size of the memory chunks and the read size of capture_buffer.
+    const size_t CAPTURE_CHUNK=0x10000;
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Buffer for capturing large process outputs. (Linux & OSX)
+    /*! Data is read from the pipe directly into fixed size memory chunks. Consumed chunks are recycled
+      so the buffer works as a ring when the data is processed while the child is still running. When the
+      memory cap is reached, further data is spilled into an anonymous temporary file (memfd on Linux).
+      Data can be read without copying with peek and consume. Spilled data is mapped into memory for
+      peek. See process::capture_to.
+    */
+    class capture_buffer
+    {
+    public:
+        //! Creates an empty buffer. \param cap Maximum number of bytes kept in memory.
+        capture_buffer(size_t cap=C4S_CAPTURE_MEMCAP);
+        ~capture_buffer();
+
+        //! Reads the nonblocking descriptor until it is empty. At end of file fd is closed and set to zero.
+        size_t read_from(int &fd);
+        //! Appends data to the end of the buffer.
+        void append(const char *data, size_t len);
+        //! Returns the first contiguous block of unconsumed data. \retval size_t Length of the block.
+        size_t peek(const char **data);
+        //! Discards the given number of bytes from the beginning of the buffer.
+        void consume(size_t len);
+        //! Discards all data and the spill file content.
+        void clear();
+
+        //! Returns the number of unconsumed bytes.
+        size_t size() { return mem_size + file_size - file_pos; }
+        //! Returns true if buffer is empty.
+        bool empty() { return size()==0; }
+        //! Returns true if some of the data is in the spill file.
+        bool spilled() { return file_size>0; }
+        //! Sets the maximum number of bytes kept in memory. Takes effect for the data appended later.
+        void set_mem_cap(size_t cap) { mem_cap = cap; }
+        //! Returns the maximum number of bytes kept in memory.
+        size_t get_mem_cap() { return mem_cap; }
+
+        //! Returns the unconsumed data as a string.
+        string str();
+        //! Writes the unconsumed data into the stream.
+        void write_to(ostream &);
+
+        //! Directory for spill files. If empty, Linux uses memfd (RAM, swappable) and OSX uses /tmp.
+        static string spill_dir;
+
+    protected:
+        char* space(size_t *len);
+        void open_spill();
+        void spill(const char *data, size_t len);
+        size_t spill_from(int &fd);
+        void unmap();
+        bool release();
+
+        std::deque<char*> chunks;   //!< Memory chunks. Last one may be partially filled.
+        std::vector<char*> spare;   //!< Consumed chunks waiting for reuse.
+        size_t head;                //!< Read offset in the first chunk.
+        size_t tail;                //!< Write offset in the last chunk.
+        size_t mem_size;            //!< Unconsumed bytes in memory.
+        size_t mem_cap;             //!< Maximum bytes in memory.
+        int spill_fd;               //!< Spill file or -1 if not created yet.
+        size_t file_size;           //!< Bytes written into the spill file.
+        size_t file_pos;            //!< Bytes consumed from the spill file.
+        char *map;                  //!< Mapping of the spill file for peek.
+        size_t map_len;             //!< Length of the mapping.
+    };
+}
+#endif
@@ -38,6 +38,12 @@ force if it has not stopped by itself by then. Must define an integer value. */
 #define C4S_PROC_TIMEOUT 15
 #endif
 
+/* Specifies the default number of milliseconds process::stop waits after the termination signal before the
+process is killed by force. Must define an integer value. */
+#ifndef C4S_PROC_GRACE
+#define C4S_PROC_GRACE 3000
+#endif
+
 /* Forces path separator to be native to the runtime environment for path-class.  Automatic
 conversion is performed at the run-time. E.g. source code has a constant string
 "./config/file.xml". If define has been used and the code is run in Windows the path-class
@@ -62,6 +68,12 @@ converts the string to: ".\config\file.xml"*/
 #define C4S_LOG_VABUFFER_SIZE 0x800
 #endif
 
+/* Specifies the default number of bytes capture_buffer keeps in memory before it spills the rest of the
+   output to an anonymous temporary file.*/
+#ifndef C4S_CAPTURE_MEMCAP
+#define C4S_CAPTURE_MEMCAP 0x4000000
+#endif
+
 /* Causes (a whole lot of) debug / trace information to appear on stdout. For developer use only!*/
 //#ifndef C4S_DEBUGTRACE
 //#define C4S_DEBUGTRACE
@@ -72,10 +84,10 @@ converts the string to: ".\config\file.xml"*/
   #include <stddef.h>
   #include <unistd.h>
   #include <errno.h>
+  #include <spawn.h>
   #if defined (STLPORT) && !defined _STLP_USE_UNIX_IO
    #error Unix io is needed in linux build
   #endif
-  const int MAX_PROCESS_ARGS = 100;
   #define HANDLE pid_t
   typedef long long int __int64;
   #define C4S_DSEP '/'
@@ -0,0 +1,381 @@
+/*******************************************************************************
+c4s_fork_server.cpp
+Implementation for fork_server-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifdef C4S_LIB_BUILD
+ #include <string.h>
+ #include <iostream>
+ #include <vector>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <signal.h>
+ #include <sched.h>
+ #include <sys/wait.h>
+ #include <sys/socket.h>
+ #include <sys/syscall.h>
+ #include "c4s_config.hpp"
+ #include "c4s_exception.hpp"
+ #include "c4s_path.hpp"
+ #include "c4s_process.hpp"
+ #include "c4s_fork_server.hpp"
+ using namespace c4s;
+#endif
+
+#ifdef __linux
+// Descriptors passed with each request: stdin, stdout, stderr and the working directory.
+const int FS_FDS=4;
+
+struct fs_request
+{
+    uint32_t argc;      //!< Number of arguments.
+    uint32_t envc;      //!< Number of environment strings.
+    uint64_t length;    //!< Length of the zero terminated strings that follow the request.
+    uint32_t group;     //!< PROC_GROUP of the child.
+    proc_controls controls; //!< Scheduling and resource controls of the child.
+};
+struct fs_reply
+{
+    int32_t pid;        //!< Child process id or zero if the clone failed.
+    int32_t err;        //!< Errno of the failed clone or exec. Zero on success.
+};
+
+int c4s::fork_server::sock = -1;
+pid_t c4s::fork_server::server_pid = 0;
+std::mutex c4s::fork_server::lock;
+
+// ==================================================================================================
+static bool fs_read(int fd, void *buffer, size_t len)
+{
+    char *ptr = (char*)buffer;
+    while(len>0) {
+        ssize_t br = read(fd, ptr, len);
+        if(br<0 && errno==EINTR)
+            continue;
+        if(br<=0) {
+            if(br==0)
+                errno = EPIPE;
+            return false;
+        }
+        ptr += br;
+        len -= br;
+    }
+    return true;
+}
+
+// ==================================================================================================
+static bool fs_write(int fd, const void *buffer, size_t len)
+{
+    const char *ptr = (const char*)buffer;
+    while(len>0) {
+        ssize_t bw = send(fd, ptr, len, MSG_NOSIGNAL);
+        if(bw<0 && errno==EINTR)
+            continue;
+        if(bw<0)
+            return false;
+        ptr += bw;
+        len -= bw;
+    }
+    return true;
+}
+
+// ==================================================================================================
+static bool fs_send_request(int fd, fs_request *req, int *fds)
+/*! Sends the request header and attaches the descriptors into it.
+ */
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int)*FS_FDS)];
+        struct cmsghdr align;
+    } ctl;
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buffer;
+    msg.msg_controllen = sizeof(ctl.buffer);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int)*FS_FDS);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int)*FS_FDS);
+    ssize_t bw;
+    do {
+        bw = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }while(bw<0 && errno==EINTR);
+    if(bw<0)
+        return false;
+    // Descriptors travel with the first byte. Rest of a partial header is sent as plain data.
+    return fs_write(fd, (char*)req+bw, sizeof(*req)-bw);
+}
+
+// ==================================================================================================
+static bool fs_recv_request(int fd, fs_request *req, int *fds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int)*FS_FDS)];
+        struct cmsghdr align;
+    } ctl;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buffer;
+    msg.msg_controllen = sizeof(ctl.buffer);
+    ssize_t br;
+    do {
+        br = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    }while(br<0 && errno==EINTR);
+    if(br<=0)
+        return false;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if(!cm || cm->cmsg_type!=SCM_RIGHTS || cm->cmsg_len!=CMSG_LEN(sizeof(int)*FS_FDS))
+        return false;
+    memcpy(fds, CMSG_DATA(cm), sizeof(int)*FS_FDS);
+    return fs_read(fd, (char*)req+br, sizeof(*req)-br);
+}
+
+// ==================================================================================================
+bool c4s::fork_server::start()
+/*! Server is forked from the calling process. It closes all inherited descriptors except the standard
+  ones and ignores the keyboard signals, so that Ctrl-C stops the script but not the server. Server exits
+  when the parent closes the socket, i.e. at stop or when the parent exits.
+  \retval bool True if the server was started, false if it was already running.
+*/
+{
+    int sv[2];
+    std::lock_guard<std::mutex> guard(lock);
+    if(server_pid)
+        return false;
+    if(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == -1) {
+        ostringstream os;
+        os << "fork_server::start - Unable to create socket: "<<strerror(errno);
+        throw process_exception(os.str());
+    }
+    pid_t pid = fork();
+    if(pid == -1) {
+        int er = errno;
+        close(sv[0]);
+        close(sv[1]);
+        ostringstream os;
+        os << "fork_server::start - Unable to fork the server: "<<strerror(er);
+        throw process_exception(os.str());
+    }
+    if(!pid) {
+        if(sv[1] != 3) {
+            dup2(sv[1], 3);
+            fcntl(3, F_SETFD, FD_CLOEXEC);
+        }
+#ifdef SYS_close_range
+        if(syscall(SYS_close_range, 4, ~0U, 0) == -1)
+#endif
+        {
+            for(long fd=4, maxfd=sysconf(_SC_OPEN_MAX); fd<maxfd; fd++)
+                close(fd);
+        }
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+        serve(3);
+    }
+    close(sv[1]);
+    sock = sv[0];
+    server_pid = pid;
+    process::default_launch = PROC_LAUNCH::SERVER;
+    return true;
+}
+
+// ==================================================================================================
+void c4s::fork_server::stop()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    shutdown();
+}
+
+// ==================================================================================================
+void c4s::fork_server::shutdown()
+/*! Closes the socket and waits for the server to exit. Caller must hold the lock.
+ */
+{
+    if(sock>=0) {
+        close(sock);
+        sock = -1;
+    }
+    if(server_pid) {
+        while(waitpid(server_pid, 0, 0) == -1 && errno == EINTR)
+            ;
+        server_pid = 0;
+    }
+    if(process::default_launch == PROC_LAUNCH::SERVER)
+        process::default_launch = PROC_LAUNCH::SPAWN;
+}
+
+// ==================================================================================================
+pid_t c4s::fork_server::spawn(char **argv, int fd_in, int fd_out, int fd_err, PROC_GROUP group,
+                              const proc_controls *controls)
+/*! Sends the launch request to the server and waits for the reply. Child gets the current environment
+  and working directory of the caller. Child has been reaped if the exec fails.
+  \param argv Argument vector. First item is the full path to the executable.
+  \param fd_in Child's stdin.
+  \param fd_out Child's stdout.
+  \param fd_err Child's stderr.
+  \param group Process group of the child.
+  \param controls Optional scheduling and resource controls for the child.
+  \retval pid_t Process id of the child.
+*/
+{
+    fs_request req;
+    fs_reply rep;
+    string data;
+    memset((void*)&req, 0, sizeof(req));
+    req.group = (uint32_t)group;
+    if(controls)
+        req.controls = *controls;
+    for(char **ap=argv; *ap; ap++, req.argc++)
+        data.append(*ap, strlen(*ap)+1);
+    for(char **ep=environ; ep && *ep; ep++, req.envc++)
+        data.append(*ep, strlen(*ep)+1);
+    req.length = data.size();
+
+    int fds[FS_FDS] = { fd_in, fd_out, fd_err, -1 };
+    fds[3] = open(".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if(fds[3] == -1) {
+        ostringstream os;
+        os << "fork_server::spawn - Unable to open current directory: "<<strerror(errno);
+        throw process_exception(os.str());
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if(sock<0) {
+        close(fds[3]);
+        throw process_exception("fork_server::spawn - Server is not running.");
+    }
+    bool ok = fs_send_request(sock, &req, fds)
+        && fs_write(sock, data.data(), data.size())
+        && fs_read(sock, &rep, sizeof(rep));
+    int er = errno;
+    close(fds[3]);
+    if(!ok) {
+        shutdown();
+        ostringstream os;
+        os << "fork_server::spawn - Lost connection to the server: "<<strerror(er);
+        throw process_exception(os.str());
+    }
+    if(rep.err) {
+        if(rep.pid>0) {
+            while(waitpid(rep.pid, 0, 0) == -1 && errno == EINTR)
+                ;
+        }
+        ostringstream os;
+        os << "process::start - Unable to spawn process:"<<argv[0]<<". Error ("<<rep.err<<") "<<strerror(rep.err);
+        throw process_exception(os.str());
+    }
+    return rep.pid;
+}
+
+// ==================================================================================================
+void c4s::fork_server::serve(int fd)
+/*! Server loop. Never returns. Exec status is passed from the child through a close-on-exec pipe: end of
+  file means the exec succeeded, otherwise the child writes the errno before it exits.
+  \param fd Server's end of the socket.
+*/
+{
+    fs_request req;
+    fs_reply rep;
+    int fds[FS_FDS], ep[2];
+    std::vector<char> data;
+    std::vector<char*> ptrs;
+    struct sigaction sa;
+    sigset_t empty_set;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&empty_set);
+
+    for(;;) {
+        if(!fs_recv_request(fd, &req, fds))
+            _exit(0);
+        data.resize(req.length+1);
+        if(req.length>0 && !fs_read(fd, &data[0], req.length))
+            _exit(0);
+        data[req.length] = 0;
+        // Argument vector and environment are both null terminated.
+        ptrs.clear();
+        char *ptr = &data[0], *end = &data[0]+req.length;
+        for(uint32_t ndx=0; ndx<req.argc+req.envc; ndx++) {
+            if(ndx == req.argc)
+                ptrs.push_back(0);
+            ptrs.push_back(ptr < end ? ptr : end);
+            ptr += strlen(ptrs.back())+1;
+        }
+        if(req.envc == 0)
+            ptrs.push_back(0);
+        ptrs.push_back(0);
+
+        rep.pid = 0;
+        rep.err = 0;
+        if(req.argc == 0)
+            rep.err = EINVAL;
+        else if(pipe2(ep, O_CLOEXEC) == -1)
+            rep.err = errno;
+        else {
+            // Child becomes the child of the server's parent.
+            pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT|SIGCHLD, 0, 0, 0, 0);
+            if(pid == 0) {
+                for(int sig=1; sig<NSIG; sig++)
+                    sigaction(sig, &sa, 0);
+                sigprocmask(SIG_SETMASK, &empty_set, 0);
+                if(req.group == (uint32_t)PROC_GROUP::GROUP)
+                    setpgid(0, 0);
+                else if(req.group == (uint32_t)PROC_GROUP::SESSION)
+                    setsid();
+                errno = req.controls.apply();
+                if(errno == 0 && fchdir(fds[3]) == 0 && dup2(fds[0], STDIN_FILENO) != -1
+                   && dup2(fds[1], STDOUT_FILENO) != -1 && dup2(fds[2], STDERR_FILENO) != -1)
+                    execve(ptrs[0], &ptrs[0], &ptrs[req.argc+1]);
+                int er = errno;
+                while(write(ep[1], &er, sizeof(er)) == -1 && errno == EINTR)
+                    ;
+                _exit(127);
+            }
+            close(ep[1]);
+            if(pid == -1)
+                rep.err = errno;
+            else {
+                rep.pid = pid;
+                ssize_t br;
+                do {
+                    br = read(ep[0], &rep.err, sizeof(rep.err));
+                }while(br<0 && errno==EINTR);
+                if(br != sizeof(rep.err))
+                    rep.err = 0;
+            }
+            close(ep[0]);
+        }
+        for(int ndx=0; ndx<FS_FDS; ndx++)
+            close(fds[ndx]);
+        if(!fs_write(fd, &rep, sizeof(rep)))
+            _exit(0);
+    }
+}
+#endif
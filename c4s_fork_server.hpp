@@ -0,0 +1,67 @@
+/*******************************************************************************
+c4s_fork_server.hpp
+Defines fork_server-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifndef C4S_FORK_SERVER_HPP
+#define C4S_FORK_SERVER_HPP
+
+#include <mutex>
+
+namespace c4s {
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Helper process that launches children on behalf of a large parent. (Linux)
+    /*! Start the server early, while the parent is still small. Server is a forked copy of the parent that
+      waits for launch requests on a Unix socket. Request carries the argument vector, the environment and
+      the child's stdin, stdout, stderr and working directory as descriptors (SCM_RIGHTS). Server creates the
+      child with CLONE_PARENT so the child belongs to the calling process: pid, pidfd, wait, rusage and
+      signals work exactly as with the other launch methods. Exec failures are reported back to the caller.
+      While the server is running, processes with PROC_LAUNCH::SERVER are launched through it. start() sets
+      process::default_launch to SERVER and stop() sets it back to SPAWN. This affects only the process
+      objects constructed after the call: objects that exist already keep their launch method. Use
+      process::set_launch(PROC_LAUNCH::SERVER) to route them through the server. Processes with SERVER
+      launch are spawned normally while the server is not running. Children get default signal handlers
+      and an empty signal mask, and they inherit the umask and resource limits the server had at start.
+    */
+    class fork_server
+    {
+    public:
+        //! Starts the server and makes SERVER the default launch method for new process objects. \retval bool False if already running.
+        static bool start();
+        //! Stops the server and restores SPAWN as the default launch method for new process objects.
+        static void stop();
+        //! Returns true if the server is running.
+        static bool running() { return server_pid>0; }
+        //! Returns the process id of the server or zero if it is not running.
+        static pid_t get_pid() { return server_pid; }
+
+        //! Launches the child through the server. \retval pid_t Process id of the child.
+        static pid_t spawn(char **argv, int fd_in, int fd_out, int fd_err, PROC_GROUP group=PROC_GROUP::INHERIT,
+                           const proc_controls *controls=0);
+
+    protected:
+        static void serve(int fd);
+        static void shutdown();
+
+        static int sock;            //!< Parent's end of the socket or -1.
+        static pid_t server_pid;    //!< Server process or zero.
+        static std::mutex lock;     //!< Serializes the requests.
+    };
+}
+#endif
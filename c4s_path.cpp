@@ -25,6 +25,18 @@ Copyright (c) Menacon Ltd, Finland
     #include <sys/stat.h>
     #include <dirent.h>
     #include <fcntl.h>
+    #include <unistd.h>
+    #include <thread>
+    #include <mutex>
+    #include <condition_variable>
+    #include <memory>
+    #include <atomic>
+    #include <chrono>
+  #endif
+  #ifdef __linux
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
+    #include <sys/sysmacros.h>
   #endif
   #ifdef _WIN32
     #include <direct.h>
@@ -59,6 +71,8 @@ c4s::path::path(const path &p)
     dir=p.dir;
     base=p.base;
     change_time=p.change_time;
+    meta=p.meta;
+    meta_key=p.meta_key;
     flag = p.flag;
 #if defined(__linux) || defined(__APPLE__)
     owner = p.owner;
@@ -434,17 +448,16 @@ c4s::OWNER_STATUS c4s::path::owner_status()
 /**  \retval c4s::OWNER
 */
 {
-    struct stat dsbuf;
     if(!owner)
         return OWNER_STATUS::EMPTY;
     if(!owner->is_ok())
         return OWNER_STATUS::MISSING;
-    if(stat(get_dir_plain().c_str(),&dsbuf))
+    const path_stat &ps = get_stat();
+    if(!ps.found || !ps.mode)
         return OWNER_STATUS::NOPATH;
-    if(owner->match(dsbuf.st_uid, dsbuf.st_gid)) {
+    if(owner->match(ps.uid, ps.gid)) {
         if(mode >= 0) {
-            string fp = base.empty() ? get_dir_plain() : get_path();
-            if( get_path_mode(fp.c_str()) == mode)
+            if( mode2hex(ps.mode) == mode)
                 return OWNER_STATUS::OK;
             else
                 return OWNER_STATUS::NOMATCH_MODE;
@@ -460,17 +473,17 @@ void c4s::path::owner_read()
   If path does not exist an exception is thrown.
 */
 {
-    struct stat dsbuf;
     if(!exists())
         throw path_exception("Cannot read owner for non-existing path.");
     if(!owner)
         throw path_exception("Cannot read owner into null.");
-    if(stat(get_dir_plain().c_str(),&dsbuf)) {
+    const path_stat &ps = get_stat();
+    if(!ps.mode) {
         ostringstream os;
-        os << "Unable to get ownership for file:"<<get_path()<<". Error:"<<strerror(errno);
+        os << "Unable to get ownership for file:"<<get_path()<<". Error:"<<strerror(ENOENT);
         throw path_exception(os.str());
     }
-    owner->set(dsbuf.st_uid, dsbuf.st_gid);
+    owner->set(ps.uid, ps.gid);
 }
 
 // ==================================================================================================
@@ -490,6 +503,7 @@ void c4s::path::owner_write()
     if(!exists())
         throw path_exception("Cannot write owner for non-existing path");
     string fp = base.empty() ? get_dir_plain() : get_path();
+    clear_stat();
     if(chown(fp.c_str(), owner->get_uid(), owner->get_gid())) {
         os << "Unable to set path owner for "<<get_path()<<" - system error: "<<strerror(errno);
         throw c4s_exception(os.str());
@@ -499,10 +513,9 @@ void c4s::path::owner_write()
 void c4s::path::read_mode()
 //! Reads current path mode from file system.
 {
-    string fp = base.empty() ? get_dir_plain() : get_path();
-    int pm = get_path_mode(fp.c_str());
-    if(pm>=0)
-        mode = pm;
+    const path_stat &ps = get_stat();
+    if(ps.found && ps.mode)
+        mode = mode2hex(ps.mode);
 }
 
 // SECTION for Linux and Apple ENDS
@@ -682,8 +695,16 @@ void c4s::path::merge(const path &append)
 
 // ==================================================================================================
 bool c4s::path::dirname_exists() const
+/*! If the base is empty the answer comes from the metadata, see get_stat. Otherwise a found file also
+  tells that its directory exists.
+*/
 {
 #if defined(__linux) || defined(__APPLE__)
+    if(base.empty())
+        return get_stat().is_dir();
+    if(meta.found && meta_key.size() == dir.size()+base.size() && !meta_key.compare(0, dir.size(), dir)
+       && !meta_key.compare(dir.size(), string::npos, base))
+        return true;
     struct stat file_stat;
     if(!stat(get_dir_plain().c_str(), &file_stat)) {
         if(S_ISDIR(file_stat.st_mode))
@@ -725,6 +746,7 @@ void c4s::path::mkdir() const
   as directory is created.
 */
 {
+    clear_stat();
     string fullpath;
     path mkpath;
     if(is_absolute())
@@ -784,13 +806,333 @@ void c4s::path::mkdir() const
     }while( offset != string::npos );
 }
 
+#if defined(__linux) || defined(__APPLE__)
+// Recursive delete. Every directory is a node that stays open until its own scan and all of its subdirectories
+// are done. Whoever finishes last removes it from the parent with unlinkat. Entries are handled relative to
+// the directory descriptors so the depth of the tree is not limited by the path length. Subtrees below
+// RM_DEPTH levels are removed by one worker with two descriptors (rm_deep), so open descriptors stay below
+// about RM_QUEUE + 2 * RM_DEPTH per worker.
+struct rm_node {
+    rm_node() : fd(-1), depth(0), pending(1) { }
+    ~rm_node() { if(fd>=0) close(fd); }
+    std::shared_ptr<rm_node> parent;    // Null for the root.
+    string name;                        // Name in the parent.
+    int fd;
+    unsigned int depth;                 // Levels below the root.
+    std::atomic<int> pending;           // Own scan and the unfinished subdirectories.
+};
+struct rm_tree {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<std::shared_ptr<rm_node> > jobs;    // Directories to scan. Newest first.
+    unsigned int busy;                  // Workers running a job.
+    bool failed;
+    string error;                       // First error.
+    string root;                        // Root directory with trailing separator.
+};
+// Beyond this many queued directories the scanning worker descends itself. Keeps the number of open directories low.
+const size_t RM_QUEUE = 128;
+// Deeper directories are not opened as nodes.
+const unsigned int RM_DEPTH = 32;
+
+static string rm_error(rm_tree *rt, const rm_node *node, const char *what, const char *name, int err)
+{
+    string name_path;
+    for(; node && node->parent; node = node->parent.get())
+        name_path = node->name + C4S_DSEP + name_path;
+    ostringstream os;
+    os << "path::rmdir - "<<what<<": "<<rt->root<<name_path<<(name ? name : "")<<" - "<<strerror(err);
+    return os.str();
+}
+
+static string rm_done(rm_tree *rt, std::shared_ptr<rm_node> node)
+/* Ends one pending task of the node. Removes the emptied directories upwards. Root is left to the caller. */
+{
+    while(node->parent && --node->pending == 0) {
+        close(node->fd);
+        node->fd = -1;
+        if(unlinkat(node->parent->fd, node->name.c_str(), AT_REMOVEDIR) == -1 && errno != ENOENT)
+            return rm_error(rt, node->parent.get(), "Unable to remove directory", node->name.c_str(), errno);
+        node = node->parent;
+    }
+    return string();
+}
+
+static int rm_files(int fd, string &sub)
+/* Unlinks everything but directories from the directory. Name of the first subdirectory is set into sub.
+   Returns zero or errno. */
+{
+    int dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    DIR *dp = dfd>=0 ? fdopendir(dfd) : 0;
+    if(!dp) {
+        int err = errno;
+        if(dfd>=0)
+            close(dfd);
+        return err;
+    }
+    // Duplicate shares the offset with fd, which an earlier scan has left at the end.
+    rewinddir(dp);
+    int err = 0;
+    struct dirent *de;
+    sub.clear();
+    while(!err && (de = readdir(dp)) != 0) {
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        bool is_dir = de->d_type == DT_DIR;
+        struct stat st;
+        if(de->d_type == DT_UNKNOWN && fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            is_dir = S_ISDIR(st.st_mode);
+        if(!is_dir && unlinkat(fd, de->d_name, 0) == -1 && errno != ENOENT) {
+            if(errno != EISDIR) {
+                sub = de->d_name;
+                err = errno;
+                break;
+            }
+            is_dir = true;
+        }
+        if(is_dir && sub.empty())
+            sub = de->d_name;
+    }
+    closedir(dp);
+    return err;
+}
+
+static string rm_deep(rm_tree *rt, const rm_node *node, const char *name)
+/* Removes a subtree of the node with at most two open descriptors. Walks down through the first subdirectory
+   until an empty directory is found, then opens its parent with ".." and removes it. The parent is verified
+   by its device and inode. Depth is limited only by the memory for the names. */
+{
+    std::vector<string> names(1, string(name));
+    std::vector<std::pair<dev_t,ino_t> > parents;   // Parent of each name below the first one.
+    int fd = openat(node->fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(fd == -1)
+        return errno == ENOENT ? string() : rm_error(rt, node, "Unable to access directory", name, errno);
+    string err, sub;
+    struct stat st;
+    // Path of the entry relative to the node for error messages.
+    auto where = [&names](const string &leaf) {
+        string name_path;
+        for(size_t ndx=0; ndx<names.size(); ndx++)
+            name_path += names[ndx] + C4S_DSEP;
+        return name_path + leaf;
+    };
+    for(;;) {
+        int rv = rm_files(fd, sub);
+        if(rv) {
+            err = rm_error(rt, node, "Unable to delete", where(sub).c_str(), rv);
+            break;
+        }
+        if(!sub.empty()) {
+            int child = openat(fd, sub.c_str(), O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+            if(child == -1 && errno == ENOENT)
+                continue;
+            if(child == -1 || fstat(fd, &st) == -1) {
+                err = rm_error(rt, node, "Unable to access directory", where(sub).c_str(), errno);
+                if(child >= 0)
+                    close(child);
+                break;
+            }
+            parents.push_back(std::make_pair(st.st_dev, st.st_ino));
+            names.push_back(sub);
+            close(fd);
+            fd = child;
+            continue;
+        }
+        // Directory is empty. Climb up and remove it.
+        if(parents.empty()) {
+            close(fd);
+            fd = -1;
+            if(unlinkat(node->fd, name, AT_REMOVEDIR) == -1 && errno != ENOENT)
+                err = rm_error(rt, node, "Unable to remove directory", name, errno);
+            break;
+        }
+        int up = openat(fd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if(up == -1 || fstat(up, &st) == -1 || st.st_dev != parents.back().first || st.st_ino != parents.back().second) {
+            err = rm_error(rt, node, "Directory moved during remove", where(string()).c_str(), up == -1 ? errno : ESTALE);
+            if(up >= 0)
+                close(up);
+            break;
+        }
+        close(fd);
+        fd = up;
+        if(unlinkat(fd, names.back().c_str(), AT_REMOVEDIR) == -1 && errno != ENOENT) {
+            err = rm_error(rt, node, "Unable to remove directory", where(string()).c_str(), errno);
+            break;
+        }
+        names.pop_back();
+        parents.pop_back();
+    }
+    if(fd >= 0)
+        close(fd);
+    return err;
+}
+
+static string rm_scan(rm_tree *rt, std::shared_ptr<rm_node> node)
+/* Unlinks the files of the directory and queues the subdirectories. */
+{
+    int dfd = fcntl(node->fd, F_DUPFD_CLOEXEC, 0);
+    DIR *dp = dfd>=0 ? fdopendir(dfd) : 0;
+    if(!dp) {
+        int err = errno;
+        if(dfd>=0)
+            close(dfd);
+        return rm_error(rt, node.get(), "Unable to read directory", 0, err);
+    }
+    rewinddir(dp);
+    string err;
+    struct dirent *de;
+    while(err.empty() && (de = readdir(dp)) != 0) {
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        bool is_dir = de->d_type == DT_DIR;
+        struct stat st;
+        if(de->d_type == DT_UNKNOWN && fstatat(node->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            is_dir = S_ISDIR(st.st_mode);
+        if(!is_dir) {
+            if(unlinkat(node->fd, de->d_name, 0) == 0 || errno == ENOENT)
+                continue;
+            // Entry may have been replaced by a directory. Otherwise the error is reported below.
+            if(errno != EISDIR && errno != EPERM) {
+                err = rm_error(rt, node.get(), "Unable to delete file", de->d_name, errno);
+                break;
+            }
+        }
+        if(node->depth >= RM_DEPTH) {
+            err = rm_deep(rt, node.get(), de->d_name);
+            continue;
+        }
+        std::shared_ptr<rm_node> child = std::make_shared<rm_node>();
+        child->fd = openat(node->fd, de->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if(child->fd == -1) {
+            if(errno == ENOENT)
+                continue;
+            if(errno == ENOTDIR || errno == ELOOP) {
+                if(unlinkat(node->fd, de->d_name, 0) == 0 || errno == ENOENT)
+                    continue;
+                err = rm_error(rt, node.get(), "Unable to delete file", de->d_name, errno);
+            }
+            else
+                err = rm_error(rt, node.get(), "Unable to access directory", de->d_name, errno);
+            break;
+        }
+        child->parent = node;
+        child->name = de->d_name;
+        child->depth = node->depth + 1;
+        node->pending++;
+        bool queued = false;
+        {
+            std::lock_guard<std::mutex> guard(rt->lock);
+            if(rt->jobs.size() < RM_QUEUE) {
+                rt->jobs.push_back(child);
+                rt->wake.notify_one();
+                queued = true;
+            }
+        }
+        if(!queued)
+            err = rm_scan(rt, child);
+    }
+    closedir(dp);
+    if(!err.empty())
+        return err;
+    return rm_done(rt, node);
+}
+
+static void rm_worker(rm_tree *rt)
+{
+    for(;;) {
+        std::shared_ptr<rm_node> node;
+        {
+            std::unique_lock<std::mutex> guard(rt->lock);
+            while(rt->jobs.empty() && rt->busy && !rt->failed)
+                rt->wake.wait(guard);
+            if(rt->failed || rt->jobs.empty()) {
+                rt->wake.notify_all();
+                return;
+            }
+            node.swap(rt->jobs.back());
+            rt->jobs.pop_back();
+            rt->busy++;
+        }
+        string err = rm_scan(rt, node);
+        node.reset();
+        std::lock_guard<std::mutex> guard(rt->lock);
+        rt->busy--;
+        if(!err.empty() && !rt->failed) {
+            rt->failed = true;
+            rt->error = err;
+        }
+        if(rt->jobs.empty() && !rt->busy)
+            rt->wake.notify_all();
+    }
+}
+
+static string rm_run(const string &dir)
+/* Removes the directory tree with path::tree_threads workers. \retval string Error message or empty on success. */
+{
+    rm_tree rt;
+    rt.busy = 0;
+    rt.failed = false;
+    rt.root = dir;
+    std::shared_ptr<rm_node> root = std::make_shared<rm_node>();
+    root->fd = open(dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(root->fd == -1)
+        return errno == ENOENT ? string() : rm_error(&rt, 0, "Unable to access directory", 0, errno);
+    rt.jobs.push_back(root);
+    root.reset();
+
+    unsigned int workers = c4s::path::tree_threads ? c4s::path::tree_threads : std::thread::hardware_concurrency();
+    if(workers == 0)
+        workers = 1;
+    std::vector<std::thread> pool;
+    for(unsigned int ndx=1; ndx<workers; ndx++)
+        pool.push_back(std::thread(rm_worker, &rt));
+    rm_worker(&rt);
+    for(size_t ndx=0; ndx<pool.size(); ndx++)
+        pool[ndx].join();
+    if(rt.failed)
+        return rt.error;
+    if(::rmdir(dir.c_str()) && errno != ENOENT)
+        return rm_error(&rt, 0, "Unable to remove directory", 0, errno);
+    return string();
+}
+
+// Background removals started by path::rmdir_async. Pending ones are waited for at exit.
+struct rm_trash {
+    rm_trash() : count(0) { }
+    ~rm_trash() { wait(); }
+    string wait() {
+        std::vector<std::thread> running;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running.swap(threads);
+        }
+        for(size_t ndx=0; ndx<running.size(); ndx++)
+            running[ndx].join();
+        std::lock_guard<std::mutex> guard(lock);
+        string err;
+        err.swap(error);
+        return err;
+    }
+    std::mutex lock;
+    std::vector<std::thread> threads;
+    string error;                       // First error since the last wait.
+    unsigned int count;                 // Trash names created.
+};
+static rm_trash trash_bin;
+#endif
+
 // ==================================================================================================
 void c4s::path::rmdir(bool recursive) const
 /*!  Base name is ignored. If recursive is not set then the exception is thrown if the
   directory is not empty. If directory is not found this function does nothing.
+  On Linux and OSX the recursive delete is done by tree_threads workers. Entries are removed relative to
+  directory descriptors and the entry type is checked with fstatat if the file system does not report it.
+  Levels below the 32nd are removed by a single worker that keeps only two directories open, so the depth
+  is not limited by the path length or by the number of open files.
   \param recursive If true then the directory is deleted recursively. USE WITH CARE!
 */
 {
+    clear_stat();
 #if defined(__linux) || defined(__APPLE__)
     if(!::rmdir(dir.c_str()))
         return;
@@ -808,48 +1150,9 @@ void c4s::path::rmdir(bool recursive) const
         os << "path::rmdir - Directory to be removed is not empty: "<<dir;
         throw path_exception(os.str().c_str());
     }
-    // Open the directory
-    DIR *target_dir = opendir(dir.c_str());
-    if(!target_dir)
-    {
-        ostringstream os;
-        os << "path::rmdir - Unable to access directory: "<<dir<<'\n'<<strerror(errno);
-        throw path_exception(os.str().c_str());
-    }
-
-    char filename[1024];
-    struct dirent *de = readdir(target_dir);
-    while(de)
-    {
-        strcpy(filename,dir.c_str());
-        strcat(filename,de->d_name);
-        if(de->d_type == DT_DIR)
-        {
-            if( strcmp(de->d_name,".") && strcmp(de->d_name,"..") )
-            {
-                strcat(filename,"/");
-                path child(filename);
-                child.rmdir(true);
-            }
-        }
-        else
-        {
-            if(unlink(filename)==-1)
-            {
-                ostringstream os;
-                os << "path::rmdir - Unable to delete file from to be removed directory: "<<filename<<'\n'<<strerror(errno);
-                throw path_exception(os.str().c_str());
-            }
-        }
-        de = readdir(target_dir);
-    }
-    closedir(target_dir);
-    if(::rmdir(dir.c_str()))
-    {
-        ostringstream os;
-        os << "path::rmdir - Unable to remove directory: "<<dir<<'\n'<<strerror(errno);
-        throw path_exception(os.str().c_str());
-    }
+    string err = rm_run(dir);
+    if(!err.empty())
+        throw path_exception(err);
 #endif
 #ifdef _WIN32
     //cout << "DEBUG - path::rmdir:"<<dir<<" | "<<get_dir_plain()<<'\n';
@@ -916,10 +1219,177 @@ void c4s::path::rmdir(bool recursive) const
 #endif
 }
 
+// ==================================================================================================
+void c4s::path::rmdir_async() const
+/*! Base name is ignored. On Linux and OSX the directory is first renamed to a hidden trash name in the same
+  parent directory and then deleted recursively in a background thread. Function returns as soon as the
+  directory is out of the way. Use rmdir_wait to wait for the deletions and to check their errors. Pending
+  deletions are also waited for when the program exits. On Windows this is the same as rmdir(true).
+  If directory is not found this function does nothing. USE WITH CARE!
+*/
+{
+    clear_stat();
+#if defined(__linux) || defined(__APPLE__)
+    string from(dir);
+    while(from.size() > 1 && from[from.size()-1] == C4S_DSEP)
+        from.erase(from.size()-1);
+    size_t slash = from.rfind(C4S_DSEP);
+    string parent = slash == string::npos ? string() : from.substr(0, slash+1);
+    string name = slash == string::npos ? from : from.substr(slash+1);
+    ostringstream trash;
+    {
+        std::lock_guard<std::mutex> guard(trash_bin.lock);
+        trash << parent << '.' << name << ".trash-" << getpid() << '-' << ++trash_bin.count;
+    }
+    if(rename(from.c_str(), trash.str().c_str()) == -1) {
+        if(errno == ENOENT)
+            return;
+        ostringstream os;
+        os << "path::rmdir_async - Unable to move directory to trash: "<<dir<<" - "<<strerror(errno);
+        throw path_exception(os.str().c_str());
+    }
+    string target = trash.str() + C4S_DSEP;
+    std::lock_guard<std::mutex> guard(trash_bin.lock);
+    trash_bin.threads.push_back(std::thread([target]() {
+        string err = rm_run(target);
+        if(err.empty())
+            return;
+        std::lock_guard<std::mutex> guard(trash_bin.lock);
+        if(trash_bin.error.empty())
+            trash_bin.error = err;
+    }));
+#endif
+#ifdef _WIN32
+    rmdir(true);
+#endif
+}
+
+// ==================================================================================================
+void c4s::path::rmdir_wait()
+/*! Waits until the deletions started with rmdir_async have completed.
+  \throw path_exception With the first error if a deletion has failed since the previous call.
+*/
+{
+#if defined(__linux) || defined(__APPLE__)
+    string err = trash_bin.wait();
+    if(!err.empty())
+        throw path_exception(err);
+#endif
+}
+
+// ==================================================================================================
+bool c4s::path_stat::is_dir() const
+{
+    return (mode & S_IFMT) == S_IFDIR;
+}
+bool c4s::path_stat::is_file() const
+{
+    return (mode & S_IFMT) == S_IFREG;
+}
+
+#if defined(__linux) || defined(__APPLE__)
+static int read_meta(const char *name, bool follow, path_stat &ps)
+/* Fills the metadata from a single statx call. Uses stat if the kernel does not have statx. */
+{
+#if defined(__linux) && defined(STATX_BASIC_STATS)
+    static bool no_statx = false;
+    if(!no_statx) {
+        struct statx sx;
+        if(statx(AT_FDCWD, name, follow ? 0 : AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &sx) == 0) {
+            ps.mode = sx.stx_mode;
+            ps.uid = sx.stx_uid;
+            ps.gid = sx.stx_gid;
+            ps.nlink = sx.stx_nlink;
+            ps.size = sx.stx_size;
+            ps.ino = sx.stx_ino;
+            ps.dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+            ps.mtime = sx.stx_mtime.tv_sec*1000000000LL + sx.stx_mtime.tv_nsec;
+            ps.ctime = sx.stx_ctime.tv_sec*1000000000LL + sx.stx_ctime.tv_nsec;
+            return 0;
+        }
+        if(errno != ENOSYS)
+            return -1;
+        no_statx = true;
+    }
+#endif
+    struct stat st;
+    if((follow ? stat(name, &st) : lstat(name, &st)) == -1)
+        return -1;
+    ps.mode = st.st_mode;
+    ps.uid = st.st_uid;
+    ps.gid = st.st_gid;
+    ps.nlink = st.st_nlink;
+    ps.size = st.st_size;
+    ps.ino = st.st_ino;
+    ps.dev = st.st_dev;
+#ifdef __APPLE__
+    ps.mtime = st.st_mtimespec.tv_sec*1000000000LL + st.st_mtimespec.tv_nsec;
+    ps.ctime = st.st_ctimespec.tv_sec*1000000000LL + st.st_ctimespec.tv_nsec;
+#else
+    ps.mtime = st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+    ps.ctime = st.st_ctim.tv_sec*1000000000LL + st.st_ctim.tv_nsec;
+#endif
+    return 0;
+}
+#endif
+
+// ==================================================================================================
+const c4s::path_stat& c4s::path::get_stat() const
+/*! The metadata is read from the disk with a single system call when it is queried for the first time
+  and after the path has been changed. exists(), dirname_exists(), read_mode(), owner_read(), owner_status()
+  and read_changetime() answer from it. Functions of this class that change the file clear it. Changes made
+  by others are seen only after clear_stat() or read_stat(). A missing path is not remembered: it is
+  checked again at each query.
+  \retval path_stat Metadata of the file, or of the directory if the base is empty.
+*/
+{
+    if(meta.found && meta_key.size() == dir.size()+base.size() && !meta_key.compare(0, dir.size(), dir)
+       && !meta_key.compare(dir.size(), string::npos, base))
+        return meta;
+    return read_stat();
+}
+
+// ==================================================================================================
+const c4s::path_stat& c4s::path::read_stat() const
+/*! Symbolic links are followed: link flag is set and the rest describes the target. Dangling link is
+  found but has zero mode.
+  \retval path_stat Metadata of the path. Found is false if the path does not exist.
+*/
+{
+    meta.clear();
+    meta_key = dir + base;
+    string target = base.empty() ? (dir.size()>1 ? get_dir_plain() : dir) : meta_key;
+#if defined(__linux) || defined(__APPLE__)
+    if(read_meta(target.c_str(), false, meta))
+        return meta;
+    meta.found = true;
+    if(S_ISLNK(meta.mode)) {
+        if(read_meta(target.c_str(), true, meta)) {
+            meta.clear();
+            meta.found = true;
+        }
+        meta.link = true;
+    }
+#endif
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if(GetFileAttributesEx(target.c_str(), GetFileExInfoStandard, &fad) == FALSE)
+        return meta;
+    meta.found = true;
+    meta.mode = (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? S_IFDIR : S_IFREG;
+    meta.nlink = 1;
+    meta.size = ((unsigned long long)fad.nFileSizeHigh<<32) | fad.nFileSizeLow;
+    // FILETIME counts 100 ns intervals since 1601.
+    meta.mtime = ((((long long)fad.ftLastWriteTime.dwHighDateTime<<32) | fad.ftLastWriteTime.dwLowDateTime) - 116444736000000000LL)*100;
+    meta.ctime = meta.mtime;
+#endif
+    return meta;
+}
+
 // ==================================================================================================
 bool c4s::path::exists() const
 /*! If the base is empty function calls dirname_exists().  In Linux existence of symbolic link
-  also returns true.
+  also returns true. Answer comes from the metadata, see get_stat.
   \retval bool True if dir and base exists, false if not.
 */
 {
@@ -927,14 +1397,8 @@ bool c4s::path::exists() const
         return dirname_exists();
 
 #if defined(__linux) || defined(__APPLE__)
-    // Simply stat the file
-    struct stat target;
-    if(!lstat(get_path().c_str(), &target)) {
-        if( S_ISREG(target.st_mode) || S_ISLNK(target.st_mode) ) {
-            return true;
-        }
-    }
-    return false;
+    const path_stat &ps = get_stat();
+    return ps.link || ps.is_file();
 #endif
 #ifdef _WIN32
     char foundpath[MAX_PATH],**fnamePtr=0;
@@ -1087,6 +1551,16 @@ int c4s::path::compare_times(path &target) const
 {
     if(!target.change_time)
         target.read_changetime();
+#if defined(__linux) || defined(__APPLE__)
+    // Nanoseconds when both times were read with the metadata.
+    if(meta.found && target.meta.found && meta.mode && target.meta.mode) {
+        if(meta.mtime < target.meta.mtime)
+            return -1;
+        if(meta.mtime > target.meta.mtime)
+            return 1;
+        return 0;
+    }
+#endif
     if(change_time < target.change_time)
         return -1;
     if(change_time > target.change_time)
@@ -1096,16 +1570,18 @@ int c4s::path::compare_times(path &target) const
 
 // ==================================================================================================
 TIME_T c4s::path::read_changetime()
+/*! On Linux and OSX the time comes from the metadata, see get_stat. compare_times uses its nanoseconds.
+*/
 {
 #if defined(__linux) || defined(__APPLE__)
-    struct stat statBuffer;
-    if(stat (get_path().c_str(), &statBuffer))
+    const path_stat &ps = get_stat();
+    if(!ps.found || !ps.mode)
     {
         ostringstream os;
         os << "path::read_changetime - Unable to find source file:"<<get_path().c_str();
         throw path_exception(os.str());
     }
-    change_time = statBuffer.st_mtime;
+    change_time = (TIME_T)(ps.mtime / 1000000000LL);
 #endif
 #ifdef _WIN32
     HANDLE hfile = CreateFile(get_path().c_str(),FILE_READ_ATTRIBUTES,FILE_SHARE_READ,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0);
@@ -1150,27 +1626,29 @@ void c4s::path::dos2unix()
 // ==================================================================================================
 inline bool isflag(int f,const int t) { return (f&t)==t?true:false;}
 #define IS(x) isflag(flags,x)
-int c4s::path::cp(const path &to, int flags) const
+#if defined(__linux) || defined(__APPLE__)
+static int copy_data(int fd_from, int fd_to, const struct stat &st, int flags, copy_stats *stats);
+#endif
+int c4s::path::cp(const path &to, int flags, copy_stats *stats) const
 /*! Copies this file into the target. In Linux, after the file is copied the owner and mode
-  is changed if they have been defined for the target.
+  is changed if they have been defined for the target. Holes of sparse files are preserved unless
+  PCF_DENSE is given.
   \param to Path to target file
   \param flags See PCF constants
+  \param stats If given, counters of the copy are added into it.
   \retval int Number of files copied. 1 or more if PCF_RECURSIVE is defined.
 */
 {
+    to.clear_stat();
     ostringstream ss;
-    char rb[0x4000];
-    const char *out_mode;
-    FILE *f_from, *f_to;
     path tmp_to(to);
-    size_t br;
 
     // Check for recursive copy
     if(base.empty()) {
         if(!to.base.empty())
             throw path_exception("path::cp - cannot copy directory into a file.");
         if(IS(PCF_RECURSIVE)) {
-            return copy_recursive(to,flags);
+            return copy_recursive(to,flags,stats);
         }
         throw path_exception("path::cp - source is a directory and path::RECURSIVE is not defined.");
     }
@@ -1194,6 +1672,67 @@ int c4s::path::cp(const path &to, int flags) const
 #endif
     }
 
+#if defined(__linux) || defined(__APPLE__)
+    // Open source file
+    int fd_from = open(get_path().c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd_from == -1) {
+        ss << "path::cp - Unable to open source file: "<<get_path()<<"; errno="<<errno;
+        throw path_exception(ss.str());
+    }
+    struct stat st_from;
+    if(fstat(fd_from, &st_from) == -1) {
+        ss << "path::cp - Unable to stat source file: "<<get_path()<<"; errno="<<errno;
+        close(fd_from);
+        throw path_exception(ss.str());
+    }
+    // Open target. Append is done by seeking since copy_file_range and sendfile refuse O_APPEND.
+    int oflags = O_WRONLY|O_CREAT|O_CLOEXEC;
+    if(!IS(PCF_APPEND))
+        oflags |= O_TRUNC;
+    int fd_to = open(tmp_to.get_path().c_str(), oflags, 0666);
+    if(fd_to == -1) {
+        // If the directory did not exist: create it.
+        if(!tmp_to.dirname_exists() && IS(PCF_FORCE)) {
+            tmp_to.mkdir();
+            fd_to = open(tmp_to.get_path().c_str(), oflags, 0666);
+        }
+        if(fd_to == -1) {
+            ss << "path::cp - unable to open target: "<<tmp_to.get_path()<<"; errno="<<errno;
+            close(fd_from);
+            throw path_exception(ss.str());
+        }
+#ifdef C4S_DEBUGTRACE
+        cout << "path::cp - DEBUG: Created new directory for target file\n";
+#endif
+    }
+    int err = copy_data(fd_from, fd_to, st_from, flags, stats);
+    // Mode is copied through the open descriptor. Explicit mode and owner are set below.
+    if(!err && !IS(PCF_DEFPERM) && mode==-1 && fchmod(fd_to, st_from.st_mode&07777) == -1)
+        err = errno;
+    close(fd_from);
+    if(close(fd_to) == -1 && !err)
+        err = errno;
+    if(err) {
+        ss << "path::cp - output error to: "<<tmp_to.get_path()<<"; errno="<<err;
+        throw path_exception(ss.str());
+    }
+    if(!IS(PCF_DEFPERM)) {
+#ifdef C4S_DEBUGTRACE
+        cout << "path::cp - DEBUG: Setting permissions\n";
+#endif
+        if(mode!=-1)
+            tmp_to.chmod(mode);
+        if(owner) {
+            tmp_to.owner = owner;
+            tmp_to.owner_write();
+        }
+    }
+#else
+    const char *out_mode;
+    FILE *f_from, *f_to;
+    char rb[0x4000];
+    size_t br;
+
     // Append if told so
     if(IS(PCF_APPEND))
         out_mode = "ab";
@@ -1237,22 +1776,9 @@ int c4s::path::cp(const path &to, int flags) const
     // Close the files and copy permissions.
     fclose(f_from);
     fclose(f_to);
-#if defined(__linux) || defined(__APPLE__)
-    if(!IS(PCF_DEFPERM)) {
-#ifdef C4S_DEBUGTRACE
-        cout << "path::cp - DEBUG: Setting permissions\n";
-#endif
-
-        if(mode!=-1)
-            tmp_to.chmod(mode);
-        else
-            copy_mode(tmp_to);
-        if(owner) {
-            tmp_to.owner = owner;
-            tmp_to.owner_write();
-        }
-    }
 #endif
+    if(stats)
+        stats->files++;
 
     // If this was a move operation, remove the source file.
     if(IS(PCF_MOVE))
@@ -1260,12 +1786,174 @@ int c4s::path::cp(const path &to, int flags) const
     return 1;
 }
 
+// ==================================================================================================
+#if defined(__linux) || defined(__APPLE__)
+#if defined(__linux) && !defined(FICLONE)
+ #define FICLONE _IOW(0x94, 9, int)
+#endif
+static int copy_segment(int fd_from, int fd_to, off_t len, off_t &copied)
+/* Copies len bytes, or until the end of file if len is negative, from the current offset of fd_from to
+   the current offset of fd_to. Returns zero or errno. */
+{
+    off_t left = len;
+    ssize_t bc;
+#ifdef __linux
+    bool first = true;
+    while(left) {
+        bc = copy_file_range(fd_from, 0, fd_to, 0, left<0 || left>0x40000000 ? 0x40000000 : left, 0);
+        if(bc > 0) {
+            copied += bc;
+            if(left > 0)
+                left -= bc;
+            first = false;
+        }
+        else if(bc == 0 && !first)
+            return 0;
+        else if(bc == 0)
+            break; // Files in /proc and /sys report zero length to copy_file_range.
+        else if(errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+            break;
+        else if(errno != EINTR)
+            return errno;
+    }
+    while(left) {
+        bc = sendfile(fd_to, fd_from, 0, left<0 || left>0x40000000 ? 0x40000000 : left);
+        if(bc > 0) {
+            copied += bc;
+            if(left > 0)
+                left -= bc;
+        }
+        else if(bc == 0)
+            return 0;
+        else if(errno == ENOSYS || errno == EINVAL)
+            break;
+        else if(errno != EINTR)
+            return errno;
+    }
+    if(!left)
+        return 0;
+#endif
+    std::vector<char> buffer(0x100000);
+    while(left) {
+        bc = read(fd_from, &buffer[0], left<0 || left>(off_t)buffer.size() ? buffer.size() : left);
+        if(bc == 0)
+            break;
+        if(bc < 0) {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        // Write may be short e.g. when interrupted by a signal.
+        for(ssize_t bw=0; bw<bc; ) {
+            ssize_t wr = write(fd_to, &buffer[bw], bc-bw);
+            if(wr < 0) {
+                if(errno == EINTR)
+                    continue;
+                return errno;
+            }
+            bw += wr;
+        }
+        copied += bc;
+        if(left > 0)
+            left -= bc;
+    }
+    return 0;
+}
+
+static int copy_data(int fd_from, int fd_to, const struct stat &st, int flags, copy_stats *stats)
+/* Copies the content of open file into another with the fastest method available. Methods are tried from
+  the fastest down: reflink clone (Linux, whole file only), copy_file_range, sendfile and finally a
+  read-write loop with a 1 MB buffer. A method that is not supported by the file systems is skipped and the
+  next one continues from the current offsets. If the source has fewer blocks than its size suggests, only
+  its data regions are copied (SEEK_DATA / SEEK_HOLE) and the target gets the same holes. Otherwise the
+  target is preallocated with fallocate so that large files are laid out in one piece. Copy runs until the
+  end of source file even if the file has changed since it was stat'ed.
+  Target is truncated unless PCF_APPEND is set. Only PCF_APPEND and PCF_DENSE flags are used.
+  Returns zero on success, otherwise errno.
+*/
+{
+    off_t start = 0;
+    off_t length = st.st_size;
+    off_t copied = 0;
+    if(IS(PCF_APPEND)) {
+        start = lseek(fd_to, 0, SEEK_END);
+        if(start == -1)
+            return errno;
+    }
+#ifdef __linux
+    // Clone shares the extents of the source. Works on btrfs, xfs and other CoW file systems.
+    if(!IS(PCF_APPEND) && ioctl(fd_to, FICLONE, fd_from) == 0) {
+        if(stats) {
+            stats->clones++;
+            stats->bytes += length;
+        }
+        return 0;
+    }
+#endif
+#ifdef SEEK_DATA
+    // Pseudo files, e.g. in /sys, report a size but no blocks. They are copied densely.
+    if(!IS(PCF_DENSE) && S_ISREG(st.st_mode) && st.st_blocks > 0 && (off_t)st.st_blocks*512 < length) {
+        off_t data = lseek(fd_from, 0, SEEK_DATA);
+        if(data != -1 || errno == ENXIO) {
+            off_t end = length;
+            while(data != -1) {
+                off_t hole = lseek(fd_from, data, SEEK_HOLE);
+                if(hole == -1)
+                    return errno;
+                if(lseek(fd_from, data, SEEK_SET) == -1 || lseek(fd_to, start+data, SEEK_SET) == -1)
+                    return errno;
+                off_t before = copied;
+                int err = copy_segment(fd_from, fd_to, hole-data, copied);
+                if(err)
+                    return err;
+                // Short segment means the source ended here.
+                if(copied-before < hole-data) {
+                    end = data + (copied-before);
+                    break;
+                }
+                if(hole > end)
+                    end = hole;
+                data = lseek(fd_from, hole, SEEK_DATA);
+            }
+            // ENXIO means there is no more data i.e. the rest is a hole.
+            if(data == -1 && errno != ENXIO)
+                return errno;
+            if(ftruncate(fd_to, start+end) == -1)
+                return errno;
+            if(stats) {
+                stats->bytes += copied;
+                stats->holes += end-copied;
+            }
+            return 0;
+        }
+        // File system does not support SEEK_DATA. Copy densely.
+        lseek(fd_from, 0, SEEK_SET);
+    }
+#endif
+#ifdef __linux
+    bool allocated = length>0 && fallocate(fd_to, 0, start, length) == 0;
+#else
+    bool allocated = false;
+#endif
+    int err = copy_segment(fd_from, fd_to, -1, copied);
+    if(err)
+        return err;
+    // Source shrank after the target was preallocated.
+    if(allocated && copied < length && ftruncate(fd_to, start+copied) == -1)
+        return errno;
+    if(stats)
+        stats->bytes += copied;
+    return 0;
+}
+#endif
+
 // ==================================================================================================
 void c4s::path::cat(const path &tail) const
 /*! Concatenates given file into file pointed by this path
   \param tail Ref to path that is added to the end of this file.
 */
 {
+    clear_stat();
     ostringstream ss;
     char rb[1024];
 
@@ -1309,6 +1997,7 @@ void c4s::path::copy_mode(const path &target) const
   \param target Path to target where the attributes are copied into.
 */
 {
+    target.clear_stat();
     ostringstream ss;
 #if defined(__linux) || defined(__APPLE__)
     int src = open(get_path().c_str(),O_RDONLY);
@@ -1343,62 +2032,387 @@ void c4s::path::copy_mode(const path &target) const
 }
 
 // ==================================================================================================
-int c4s::path::copy_recursive(const path &target, int flags) const
-/*! Copies everything from this directory to target. If this object has base defined it will be ignored.
-  If the target does not exist it will be created (recursively). If files exist in target they will
-  be copied over. File times are preserved. Only regular files are copied.
-  \param target Target directory for the copied files.
-*/
+// ==================================================================================================
+void c4s::copy_stats::add(const copy_stats &cs)
 {
-    int copy_count = 0;
+    files += cs.files;
+    bytes += cs.bytes;
+    holes += cs.holes;
+    clones += cs.clones;
+    dirs += cs.dirs;
+    symlinks += cs.symlinks;
+    hardlinks += cs.hardlinks;
+    seconds += cs.seconds;
+}
+
+unsigned int c4s::path::tree_threads = 0;
+
 #if defined(__linux) || defined(__APPLE__)
-    // Open the directory
-    DIR *source_dir = opendir(dir.c_str());
-    if(!source_dir)
-    {
-        ostringstream os;
-        os << "path::cpr - Unable to access directory: "<<dir<<'\n'<<strerror(errno);
-        throw path_exception(os.str().c_str());
+#ifdef __APPLE__
+ #define st_atim st_atimespec
+ #define st_mtim st_mtimespec
+#endif
+// Recursive copy. Workers take jobs from a shared stack: either a directory to scan or a batch of entries
+// in an already open directory. Entries are handled relative to the directory descriptors.
+struct tree_dir {
+    tree_dir() : src(-1), tgt(-1) { }
+    ~tree_dir() { if(src>=0) close(src); if(tgt>=0) close(tgt); }
+    int src, tgt;       // Source and target directory.
+    string tgt_path;    // Target directory with trailing separator.
+};
+struct tree_job {
+    string src, tgt;                    // Directory to scan if names is empty.
+    std::shared_ptr<tree_dir> dir;      // Directory of the names.
+    std::vector<string> names;          // Batch of entries to copy.
+};
+struct tree_link {
+    string path;                        // First copy of the file.
+    int state;                          // One of the TREE_LINK constants.
+};
+const int TREE_LINK_COPYING = 0;
+const int TREE_LINK_DONE = 1;
+const int TREE_LINK_FAILED = 2;
+struct tree_dir_time {
+    string path;
+    struct timespec times[2];
+};
+struct tree_copy {
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<tree_job> jobs;         // Newest first i.e. depth first. Keeps the number of open directories low.
+    unsigned int busy;                  // Workers running a job.
+    bool failed;
+    string error;                       // First error.
+    int flags;
+    dev_t tgt_dev;                      // Target root. Not copied into itself if it is inside the source.
+    ino_t tgt_ino;
+    copy_stats total;
+    copy_stats *report;                 // Caller's stats for progress.
+    bool reporting;                     // A worker is running the progress callback.
+    std::chrono::steady_clock::time_point start, reported;
+    std::map<std::pair<dev_t,ino_t>, tree_link> links;   // Copied files with more than one link.
+    std::condition_variable linked;     // Signals the end of a first copy in links.
+    std::vector<tree_dir_time> dir_times;
+};
+const size_t TREE_BATCH = 64;
+
+static string tree_error(const char *what, const string &dir, const char *name, int err)
+{
+    ostringstream os;
+    os << "path::copy_recursive - "<<what<<": "<<dir<<(name ? name : "")<<" - "<<strerror(err);
+    return os.str();
+}
+
+static void tree_push(tree_copy *tc, tree_job &job)
+{
+    std::lock_guard<std::mutex> guard(tc->lock);
+    tc->jobs.push_back(tree_job());
+    tc->jobs.back().src.swap(job.src);
+    tc->jobs.back().tgt.swap(job.tgt);
+    tc->jobs.back().dir = job.dir;
+    tc->jobs.back().names.swap(job.names);
+    tc->wake.notify_one();
+}
+
+static string tree_scan(tree_copy *tc, tree_job &job, copy_stats &cs)
+/* Creates the target directory and queues its entries. Subdirectories are queued as new scans. */
+{
+    std::shared_ptr<tree_dir> td = std::make_shared<tree_dir>();
+    td->tgt_path = job.tgt;
+    td->src = open(job.src.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(td->src == -1)
+        return tree_error("Unable to access directory", job.src, 0, errno);
+    if(mkdir(job.tgt.c_str(), 0777) == 0)
+        cs.dirs++;
+    else if(errno != EEXIST)
+        return tree_error("Unable to create directory", job.tgt, 0, errno);
+    td->tgt = open(job.tgt.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(td->tgt == -1)
+        return tree_error("Unable to access directory", job.tgt, 0, errno);
+    struct stat st;
+    if(fstat(td->src, &st) == 0) {
+        tree_dir_time dt;
+        dt.path = job.tgt;
+        dt.times[0] = st.st_atim;
+        dt.times[1] = st.st_mtim;
+        std::lock_guard<std::mutex> guard(tc->lock);
+        tc->dir_times.push_back(dt);
+    }
+    int dfd = fcntl(td->src, F_DUPFD_CLOEXEC, 0);
+    DIR *dp = dfd>=0 ? fdopendir(dfd) : 0;
+    if(!dp) {
+        int err = errno;
+        if(dfd>=0)
+            close(dfd);
+        return tree_error("Unable to read directory", job.src, 0, err);
+    }
+    tree_job batch;
+    struct dirent *de;
+    while((de = readdir(dp)) != 0) {
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        bool is_dir = de->d_type == DT_DIR;
+        if(de->d_type == DT_UNKNOWN && fstatat(td->src, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            is_dir = S_ISDIR(st.st_mode);
+        if(is_dir) {
+            // Hidden directories are not copied.
+            if(de->d_name[0] == '.')
+                continue;
+            if(fstatat(td->src, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+               && st.st_dev == tc->tgt_dev && st.st_ino == tc->tgt_ino)
+                continue;
+            tree_job sub;
+            sub.src = job.src + de->d_name + C4S_DSEP;
+            sub.tgt = job.tgt + de->d_name + C4S_DSEP;
+            tree_push(tc, sub);
+            continue;
+        }
+        if(batch.names.empty())
+            batch.names.reserve(TREE_BATCH);
+        batch.names.push_back(de->d_name);
+        if(batch.names.size() == TREE_BATCH) {
+            batch.dir = td;
+            tree_push(tc, batch);
+        }
     }
+    closedir(dp);
+    if(!batch.names.empty()) {
+        batch.dir = td;
+        tree_push(tc, batch);
+    }
+    return string();
+}
 
-    // Make sure the target directory exists
-    if(!target.dirname_exists())
-        target.mkdir();
+static string tree_symlink(tree_copy *tc, tree_dir *td, const char *name, const struct stat &st, copy_stats &cs)
+{
+    int flags = tc->flags;
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(td->src, name, target, sizeof(target)-1);
+    if(len == -1)
+        return tree_error("Unable to read link", td->tgt_path, name, errno);
+    target[len] = 0;
+    if(symlinkat(target, td->tgt, name) == -1) {
+        if(errno != EEXIST || !IS(PCF_FORCE) || unlinkat(td->tgt, name, 0) == -1 || symlinkat(target, td->tgt, name) == -1)
+            return tree_error("Unable to create link", td->tgt_path, name, errno);
+    }
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    utimensat(td->tgt, name, times, AT_SYMLINK_NOFOLLOW);
+    if(IS(PCF_MOVE) && unlinkat(td->src, name, 0) == -1)
+        return tree_error("Unable to remove source", td->tgt_path, name, errno);
+    cs.symlinks++;
+    return string();
+}
 
-    // Read the source directory
-    path cp_source;
-    string file_name;
-    struct stat file_stat;
-    struct dirent *de = readdir(source_dir);
-    while(de)
-    {
-        cp_source.dir=dir;
+static string tree_regular(tree_copy *tc, tree_dir *td, const char *name, const struct stat &st, copy_stats &cs)
+{
+    int flags = tc->flags;
+    if(IS(PCF_BACKUP)) {
+        string backup(name);
+        backup += '~';
+        renameat(td->tgt, name, td->tgt, backup.c_str());
+    }
+    int oflags = O_WRONLY|O_CREAT|O_CLOEXEC;
+    if(!IS(PCF_FORCE) && !IS(PCF_BACKUP))
+        oflags |= O_EXCL;
+    if(!IS(PCF_APPEND))
+        oflags |= O_TRUNC;
+    int fd_from = openat(td->src, name, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+    if(fd_from == -1)
+        return tree_error("Unable to open source file", td->tgt_path, name, errno);
+    int fd_to = openat(td->tgt, name, oflags, 0666);
+    if(fd_to == -1) {
+        int err = errno;
+        close(fd_from);
+        return tree_error(err == EEXIST ? "Target file exists" : "Unable to open target", td->tgt_path, name, err);
+    }
+    int err = copy_data(fd_from, fd_to, st, flags, &cs);
+    if(!err && !IS(PCF_DEFPERM) && fchmod(fd_to, st.st_mode&07777) == -1)
+        err = errno;
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if(!err && !IS(PCF_APPEND) && futimens(fd_to, times) == -1)
+        err = errno;
+    close(fd_from);
+    if(close(fd_to) == -1 && !err)
+        err = errno;
+    if(err)
+        return tree_error("Output error to", td->tgt_path, name, err);
+    if(IS(PCF_MOVE) && unlinkat(td->src, name, 0) == -1)
+        return tree_error("Unable to remove source", td->tgt_path, name, errno);
+    cs.files++;
+    return string();
+}
 
-        // Get the file's lstat. The dirent type is not reliable
-        file_name = dir;
-        file_name += de->d_name;
-        if(!lstat(file_name.c_str(), &file_stat))
+static string tree_file(tree_copy *tc, tree_dir *td, const char *name, const struct stat &st, copy_stats &cs)
+/* Copies a regular file. Second and later names of the same file are linked to the first copy once it is complete. */
+{
+    int flags = tc->flags;
+    if(st.st_nlink <= 1 && !IS(PCF_MOVE))
+        return tree_regular(tc, td, name, st, cs);
+    std::pair<dev_t,ino_t> key(st.st_dev, st.st_ino);
+    std::unique_lock<std::mutex> guard(tc->lock);
+    // Move unlinks the copied names so the link count of the remaining names drops. They are found by the inode.
+    if(st.st_nlink <= 1 && tc->links.find(key) == tc->links.end()) {
+        guard.unlock();
+        return tree_regular(tc, td, name, st, cs);
+    }
+    tree_link first = { td->tgt_path+name, TREE_LINK_COPYING };
+    std::pair<std::map<std::pair<dev_t,ino_t>, tree_link>::iterator, bool> li = tc->links.insert(std::make_pair(key, first));
+    if(li.second) {
+        guard.unlock();
+        string err = tree_regular(tc, td, name, st, cs);
+        guard.lock();
+        tc->links[key].state = err.empty() ? TREE_LINK_DONE : TREE_LINK_FAILED;
+        tc->linked.notify_all();
+        return err;
+    }
+    while(li.first->second.state == TREE_LINK_COPYING)
+        tc->linked.wait(guard);
+    if(li.first->second.state == TREE_LINK_FAILED)
+        return tree_error("Unable to link, copy failed", td->tgt_path, name, ENOENT);
+    first.path = li.first->second.path;
+    guard.unlock();
+    if(linkat(AT_FDCWD, first.path.c_str(), td->tgt, name, 0) == -1
+       && (errno != EEXIST || !IS(PCF_FORCE) || unlinkat(td->tgt, name, 0) == -1
+           || linkat(AT_FDCWD, first.path.c_str(), td->tgt, name, 0) == -1))
+        return tree_error("Unable to link", td->tgt_path, name, errno);
+    if(IS(PCF_MOVE) && unlinkat(td->src, name, 0) == -1)
+        return tree_error("Unable to remove source", td->tgt_path, name, errno);
+    cs.hardlinks++;
+    cs.files++;
+    return string();
+}
+
+static string tree_batch(tree_copy *tc, tree_job &job, copy_stats &cs)
+{
+    tree_dir *td = job.dir.get();
+    struct stat st;
+    for(size_t ndx=0; ndx<job.names.size(); ndx++) {
+        const char *name = job.names[ndx].c_str();
+        if(fstatat(td->src, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            return tree_error("Unable to stat", td->tgt_path, name, errno);
+        string err;
+        if(S_ISLNK(st.st_mode))
+            err = tree_symlink(tc, td, name, st, cs);
+        else if(S_ISREG(st.st_mode))
+            err = tree_file(tc, td, name, st, cs);
+        if(!err.empty())
+            return err;
+    }
+    return string();
+}
+
+static void tree_worker(tree_copy *tc)
+{
+    copy_stats cs;
+    for(;;) {
+        tree_job job;
         {
-            // If entry is a regular file: copy it
-            if(S_ISREG(file_stat.st_mode))
-            {
-                cp_source.base = de->d_name;
-                copy_count += cp_source.cp(target,flags);
+            std::unique_lock<std::mutex> guard(tc->lock);
+            while(tc->jobs.empty() && tc->busy && !tc->failed)
+                tc->wake.wait(guard);
+            if(tc->failed || tc->jobs.empty()) {
+                tc->wake.notify_all();
+                return;
             }
-            // Else if directory:
-            else if(S_ISDIR(file_stat.st_mode) && de->d_name[0]!='.')
-            {
-                cp_source.dir += de->d_name;
-                cp_source.dir += C4S_DSEP;
-                path sub_target(target);
-                sub_target.dir += de->d_name;
-                sub_target.dir += C4S_DSEP;
-                copy_count += cp_source.copy_recursive(sub_target,flags);
+            job.src.swap(tc->jobs.back().src);
+            job.tgt.swap(tc->jobs.back().tgt);
+            job.dir = tc->jobs.back().dir;
+            job.names.swap(tc->jobs.back().names);
+            tc->jobs.pop_back();
+            tc->busy++;
+        }
+        cs.clear();
+        string err = job.names.empty() ? tree_scan(tc, job, cs) : tree_batch(tc, job, cs);
+        job.dir.reset();
+        copy_stats progress;
+        bool report = false;
+        {
+            std::lock_guard<std::mutex> guard(tc->lock);
+            tc->busy--;
+            tc->total.add(cs);
+            if(!err.empty() && !tc->failed) {
+                tc->failed = true;
+                tc->error = err;
+            }
+            if(tc->jobs.empty() && !tc->busy)
+                tc->wake.notify_all();
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if(tc->report && tc->report->progress && !tc->reporting && now - tc->reported >= std::chrono::milliseconds(500)) {
+                tc->reported = now;
+                tc->reporting = true;
+                progress.add(tc->total);
+                progress.seconds = std::chrono::duration<double>(now - tc->start).count();
+                report = true;
             }
         }
-        de = readdir(source_dir);
+        // Callback runs without the lock so that a slow one does not stop the other workers.
+        if(report) {
+            tc->report->progress(progress);
+            std::lock_guard<std::mutex> guard(tc->lock);
+            tc->reporting = false;
+        }
     }
-    closedir(source_dir);
+}
+#endif
+
+// ==================================================================================================
+int c4s::path::copy_recursive(const path &target, int flags, copy_stats *stats) const
+/*! Copies everything from this directory to target. If this object has base defined it will be ignored.
+  If the target does not exist it will be created (recursively). If files exist in target they will
+  be copied over. Hidden directories are skipped.
+  On Linux and OSX the tree is copied by tree_threads workers. Entries are opened relative to directory
+  descriptors. Regular files keep their mode and times, symbolic links are recreated and files with
+  several hard links are linked to the first copy. Directory times are restored after the copy.
+  \param target Target directory for the copied files.
+  \param flags See PCF constants.
+  \param stats If given, counters and the elapsed time are added into it. See copy_stats::progress.
+  \retval int Number of files copied.
+*/
+{
+    target.clear_stat();
+    int copy_count = 0;
+#if defined(__linux) || defined(__APPLE__)
+    // Make sure the target directory exists
+    if(!target.dirname_exists())
+        target.mkdir();
+
+    tree_copy tc;
+    tc.busy = 0;
+    tc.failed = false;
+    tc.flags = flags;
+    tc.report = stats;
+    tc.reporting = false;
+    tc.tgt_dev = 0;
+    tc.tgt_ino = 0;
+    struct stat st;
+    if(stat(target.get_dir().c_str(), &st) == 0) {
+        tc.tgt_dev = st.st_dev;
+        tc.tgt_ino = st.st_ino;
+    }
+    tc.start = std::chrono::steady_clock::now();
+    tc.reported = tc.start;
+    tree_job root;
+    root.src = dir;
+    root.tgt = target.get_dir();
+    tc.jobs.push_back(root);
+
+    unsigned int workers = tree_threads ? tree_threads : std::thread::hardware_concurrency();
+    if(workers == 0)
+        workers = 1;
+    std::vector<std::thread> pool;
+    for(unsigned int ndx=1; ndx<workers; ndx++)
+        pool.push_back(std::thread(tree_worker, &tc));
+    tree_worker(&tc);
+    for(size_t ndx=0; ndx<pool.size(); ndx++)
+        pool[ndx].join();
+    if(tc.failed)
+        throw path_exception(tc.error);
+    for(size_t ndx=0; ndx<tc.dir_times.size(); ndx++)
+        utimensat(AT_FDCWD, tc.dir_times[ndx].path.c_str(), tc.dir_times[ndx].times, 0);
+    tc.total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tc.start).count();
+    if(stats)
+        stats->add(tc.total);
+    copy_count = (int)tc.total.files;
 #endif
 #ifdef _WIN32
     path cp_source(dir);
@@ -1416,7 +2430,7 @@ int c4s::path::copy_recursive(const path &target, int flags) const
     while(findNext) {
         if( (data.dwFileAttributes & FILE_ATTRIBUTE_NORMAL) == FILE_ATTRIBUTE_NORMAL) {
             cp_source.base = data.cFileName;
-            copy_count += cp_source.cp(target, flags);
+            copy_count += cp_source.cp(target, flags, stats);
         }
         if( (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY ) {
             string sdir = dir;
@@ -1426,7 +2440,7 @@ int c4s::path::copy_recursive(const path &target, int flags) const
             string tdir = dir;
             tdir += data.cFileName;
             sdir += C4S_DSEP;
-            copy_count += newsdir.copy_recursive(path(tdir),flags); // recursive copy
+            copy_count += newsdir.copy_recursive(path(tdir),flags,stats); // recursive copy
         }
         findNext = FindNextFile(find,&data);
     }
@@ -1444,6 +2458,7 @@ void c4s::path::ren(const string &new_base, bool force)
   \param force If new file alerady exist, it is deleted if force is true. Otherwice exception is thrown.
 */
 {
+    clear_stat();
     string old_base = base;
     string old = get_path();
     set_base(new_base);
@@ -1488,6 +2503,7 @@ bool c4s::path::rm() const
   \retval bool True if deletion is successful or if file does not exist. False otherwise.
 */
 {
+    clear_stat();
     string name = base.empty() ? get_dir_plain() : get_path();
 #if defined(__linux) || defined(__APPLE__)
     if(unlink(name.c_str()) < 0)
@@ -1530,6 +2546,7 @@ void c4s::path::symlink(const path &link) const
   \param link Name of the link
 */
 {
+    link.clear_stat();
     if(!exists()) {
         ostringstream os;
         os << "path::symlink - Symbolic link target:"<<get_path()<<" does no exist";
@@ -1570,6 +2587,7 @@ void c4s::path::chmod(int mode_in)
   function does nothing.
 */
 {
+    clear_stat();
     ostringstream os;
 #if defined(__linux) || defined(__APPLE__)
     if( mode_in == -1 ) {
@@ -1649,6 +2667,7 @@ int c4s::path::search_replace(const string &search, const string &replace, bool
   \retval int Number of replacements done.
  */
 {
+    clear_stat();
     char *btr, buffer[0x800];
     int count=0;
     SIZE_T reread=0, find_pos;
@@ -1716,6 +2735,7 @@ bool c4s::path::replace_block(const string &start_tag, const string &end_tag, co
   \param backup If true then original file is backed up.
   \retval bool True if replacement was done. False if start or end tag was not found. */
 {
+    clear_stat();
     char buffer[0x1000];
     streamsize br, soffset, eoffset;
 
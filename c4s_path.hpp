@@ -36,6 +36,7 @@ Copyright (c) Menacon Ltd
 #endif
 
 #include <vector>
+#include <functional>
 
 namespace c4s {
 
@@ -51,6 +52,53 @@ const int PCF_ONAME=0x8;      //!< Use original base name for the target.
 const int PCF_DEFPERM=0x10;   //!< Use default file permissions given by operating system. Note, this also overrides possible user and permission settings for the target.
 const int PCF_BACKUP=0x20;    //!< Backup original if it exists.
 const int PCF_RECURSIVE=0x40; //!< Copy recursively. Valid only if source is a directory (i.e. base is empty).
+const int PCF_DENSE=0x80;     //!< Write holes of sparse files as zeros instead of preserving them.
+
+//! Counters collected by path::cp.
+struct copy_stats
+{
+    copy_stats() { clear(); }
+    //! Sets all counters to zero. Progress function is kept.
+    void clear() { files = 0; bytes = 0; holes = 0; clones = 0; dirs = 0; symlinks = 0; hardlinks = 0; seconds = 0; }
+    //! Adds the counters of the given stats into this one.
+    void add(const copy_stats &);
+    //! Returns the data throughput in bytes per second. Zero if the time is not known.
+    double rate() const { return seconds>0 ? bytes/seconds : 0; }
+
+    unsigned long files;        //!< Files copied.
+    unsigned long long bytes;   //!< Bytes of data copied. Holes are not included.
+    unsigned long long holes;   //!< Bytes of holes preserved in sparse targets.
+    unsigned long clones;       //!< Files copied as reflink clones that share the source's data.
+    unsigned long dirs;         //!< Directories copied by recursive copy.
+    unsigned long symlinks;     //!< Symbolic links recreated by recursive copy.
+    unsigned long hardlinks;    //!< Files linked to an already copied file by recursive copy.
+    double seconds;             //!< Time spent in recursive copy.
+    //! If set, recursive copy calls this about twice a second with the counters so far.
+    std::function<void(const copy_stats&)> progress;
+};
+
+//! File system metadata of a path. See path::get_stat.
+struct path_stat
+{
+    path_stat() { clear(); }
+    //! Marks the record empty.
+    void clear() { found = false; link = false; mode = 0; uid = 0; gid = 0; nlink = 0; size = 0; ino = 0; dev = 0; mtime = 0; ctime = 0; }
+    //! Returns true if the path is a directory or a link to one.
+    bool is_dir() const;
+    //! Returns true if the path is a regular file or a link to one.
+    bool is_file() const;
+
+    bool found;                 //!< Path exists. Other fields are valid only if this is set.
+    bool link;                  //!< Path is a symbolic link. Other fields describe the link target, zero if it is missing.
+    unsigned int mode;          //!< File type and permission bits as in st_mode.
+    unsigned int uid, gid;      //!< Owner and group.
+    unsigned int nlink;         //!< Number of hard links.
+    unsigned long long size;    //!< Size in bytes.
+    unsigned long long ino;     //!< Inode number.
+    unsigned long long dev;     //!< Device of the file system.
+    long long mtime;            //!< Modification time in nanoseconds since the epoch.
+    long long ctime;            //!< Status change time in nanoseconds since the epoch.
+};
 
 //! Flags for path compare function.
 const unsigned char CMP_DIR =  1;     //!< Compare Dir parts together
@@ -102,7 +150,7 @@ enum class OWNER_STATUS : unsigned short int {
 #endif
 
         //! Sets path so that it equals another path.
-        void operator=(const path &p) { dir=p.dir; base=p.base; change_time=p.change_time; }
+        void operator=(const path &p) { dir=p.dir; base=p.base; change_time=p.change_time; meta=p.meta; meta_key=p.meta_key; }
         //! Sets the path from pointer to const char.
         void operator=(const char *p) { set(string(p)); }
         //! Sets the path from constant string.
@@ -113,7 +161,7 @@ enum class OWNER_STATUS : unsigned short int {
         void operator+=(const char *cp) { merge(path(cp)); }
 
         //! Clears the path.
-        void clear() { change_time=0; dir.clear(); base.clear(); }
+        void clear() { change_time=0; dir.clear(); base.clear(); meta.clear(); }
         //! Checks whether the path is clear (or empty). \retval bool True if empty.
         bool empty() { return dir.empty() && base.empty(); }
 
@@ -210,6 +258,12 @@ enum class OWNER_STATUS : unsigned short int {
         bool dirname_exists() const;
         //! Checks if the directory and base exists.
         bool exists() const;
+        //! Returns the metadata of the path. It is read from the disk on first use and then kept until cleared.
+        const path_stat& get_stat() const;
+        //! Reads the metadata of the path from the disk again.
+        const path_stat& read_stat() const;
+        //! Forgets the metadata so that the next query reads it from the disk.
+        void clear_stat() const { meta.clear(); }
 
         //! Sets a selection flag.
         void flag_set() { flag = true; }
@@ -225,11 +279,17 @@ enum class OWNER_STATUS : unsigned short int {
         void mkdir() const;
         //! Removes the directory from the disk this path points to.
         void rmdir(bool recursive=false) const;
+        //! Moves the directory to trash and removes it recursively in the background.
+        void rmdir_async() const;
+        //! Waits for the background removals started with rmdir_async.
+        static void rmdir_wait();
 
         //! Copy file pointed by path to a new location
-        int cp(const char *to, int flags=PCF_NONE) { path target(to); return cp(target,flags); }
+        int cp(const char *to, int flags=PCF_NONE, copy_stats *stats=0) { path target(to); return cp(target,flags,stats); }
         //! Copy file pointed by path to a new location
-        int cp(const path &, int flags=PCF_NONE) const;
+        int cp(const path &, int flags=PCF_NONE, copy_stats *stats=0) const;
+        //! Number of worker threads in recursive copy and delete (Linux & OSX). Zero uses the number of CPUs.
+        static unsigned int tree_threads;
         //! Concatenate file
         void cat(const path &) const;
         //! Rename the base part
@@ -265,13 +325,15 @@ enum class OWNER_STATUS : unsigned short int {
         //! Copies attributes and permissions from this file to target.
         void copy_mode(const path &target) const;
         //! Recursive copy from this to target.
-        int copy_recursive(const path &, int) const;
+        int copy_recursive(const path &, int, copy_stats *) const;
 
 #if defined(__linux) || defined(__APPLE__)
         user *owner;        //!< Pointer to User and group for this file's permissions
         int  mode;          //!< Path/file access mode.
 #endif
         TIME_T change_time; //!< Time that the file was last changed. Zero until internal function update_time has been called.
+        mutable path_stat meta;     //!< Metadata from the disk. See get_stat.
+        mutable string meta_key;    //!< Path the metadata was read for.
         string dir;         //!< directory part of the path. Directory needs to end at the directory separator.
         string base;        //!< Base name (file name) part of the path.
         bool flag;          //!< General purpose flag for application use.
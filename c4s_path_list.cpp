@@ -271,13 +271,14 @@ bool c4s::path_list::discard_matching(const string &tbase)
 }
 
 // ==================================================================================================
-int c4s::path_list::copy_to(const path &target, int flags)
+int c4s::path_list::copy_to(const path &target, int flags, copy_stats *stats)
 /*! Targets base is ignored if it exists => path::ONAME flag is enforced. If path list
   contains directories and flags has RECURSIVE bit set then these directories are copied
   recursively. If the flag is missing then directories are disregarded.  In case of error this
   function will leave the copy partially done. Only existing files are copied.
   \param target path to target directory
   \param flags copy flags.
+  \param stats If given, counters of the copy are added into it.
   \retval int Number of files copied.
 */
 {
@@ -289,11 +290,11 @@ int c4s::path_list::copy_to(const path &target, int flags)
             if( (flags & PCF_RECURSIVE)>0 ) {
                 path tmp_target(target);
                 tmp_target.append_last(*pi);
-                copy_count += pi->copy_recursive(tmp_target, flags);
+                copy_count += pi->copy_recursive(tmp_target, flags, stats);
             }
         }
         else if(pi->exists())
-            copy_count += pi->cp(target,flags);
+            copy_count += pi->cp(target,flags,stats);
     }
 #ifdef C4S_DEBUGTRACE
     cout << "DEBUG - path_list::copy to "<<target.get_dir()<<"copied "<<copy_count<<" files.\n";
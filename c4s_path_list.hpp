@@ -96,7 +96,7 @@ namespace c4s {
         //! Finds the name of the given base from the list and discards it from the list.
         bool discard_matching(const string &);
         //! Copies this list of files to given target directory.
-        int copy_to(const path &, int flag=PCF_NONE);
+        int copy_to(const path &, int flag=PCF_NONE, copy_stats *stats=0);
         //! Changes the given mode to all paths.
         void chmod(int mod);
         //! Copies the given string to as directory to all paths in the list.
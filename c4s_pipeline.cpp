@@ -0,0 +1,335 @@
+/*******************************************************************************
+c4s_pipeline.cpp
+Implementation for pipeline-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifdef C4S_LIB_BUILD
+ #include <string.h>
+ #include <iostream>
+ #include <sys/wait.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <poll.h>
+ #include "c4s_config.hpp"
+ #include "c4s_exception.hpp"
+ #include "c4s_path.hpp"
+ #include "c4s_process.hpp"
+ #include "c4s_pipeline.hpp"
+ using namespace c4s;
+#endif
+
+// ==================================================================================================
+c4s::pipeline::~pipeline()
+{
+    stop();
+    clear();
+}
+
+// ==================================================================================================
+void c4s::pipeline::clear()
+{
+    for(std::vector<stage*>::iterator si=stages.begin(); si!=stages.end(); si++)
+        delete *si;
+    stages.clear();
+}
+
+// ==================================================================================================
+size_t c4s::pipeline::add(const char *cmd, const char *args)
+/*! Command is searched from the path at this point. Process exception is thrown if it is not found.
+  \param cmd Command to execute.
+  \param args Arguments for the command.
+*/
+{
+    stage *ns = new stage;
+    try {
+        ns->proc.set_command(cmd);
+    }catch(const process_exception &) {
+        delete ns;
+        throw;
+    }
+    if(args)
+        ns->proc.set_args(args);
+    ns->tee = 0;
+    ns->running = false;
+    ns->rv = 0;
+    stages.push_back(ns);
+    return stages.size()-1;
+}
+
+// ==================================================================================================
+size_t c4s::pipeline::add(const string &cmd, const string &args)
+{
+    return add(cmd.c_str(), args.empty() ? 0 : args.c_str());
+}
+
+// ==================================================================================================
+size_t c4s::pipeline::add(const string &cmd, const std::vector<string> &argv)
+/*! Arguments are passed to the command as they are. See process::set_argv.
+ */
+{
+    size_t ndx = add(cmd.c_str());
+    stages.at(ndx)->proc.set_argv(argv);
+    return ndx;
+}
+
+// ==================================================================================================
+void c4s::pipeline::start()
+/*! Stages are started from first to last. Stages without tee are connected with a kernel pipe. For tee
+  stages the parent reads the output and writes it into the next stage's input.
+*/
+{
+    int link[2];
+    if(stages.empty())
+        throw process_exception("pipeline::start - Unable to start pipeline. No stages specified.");
+    stop();
+    for(size_t ndx=0; ndx<stages.size(); ndx++) {
+        stages[ndx]->pending.clear();
+        stages[ndx]->running = false;
+        stages[ndx]->rv = 0;
+    }
+    if(process::no_run) {
+        for(size_t ndx=0; ndx<stages.size(); ndx++)
+            stages[ndx]->proc.start();
+        return;
+    }
+    // Input set directly on the first stage is kept unless the pipeline has its own.
+    if(!in_path.empty())
+        stages[0]->proc.pipe_from(in_path);
+    for(size_t ndx=0; ndx<stages.size(); ndx++) {
+        stage *st = stages[ndx];
+        bool last = ndx+1 == stages.size();
+        if(!last && !st->tee) {
+            if(!proc_pipes::create_pipe(link))
+                throw process_exception("pipeline::start - Unable to create pipe between stages.");
+            st->proc.link_out = link[1];
+            stages[ndx+1]->proc.link_in = link[0];
+        }
+        st->proc.start();
+        st->running = true;
+        if(ndx>0 && stages[ndx-1]->tee) {
+            // Parent writes tee'd data into this stage without blocking.
+            int fd = st->proc.pipes->fd_in[1];
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0)|O_NONBLOCK);
+        }
+    }
+}
+
+// ==================================================================================================
+void c4s::pipeline::relay(size_t ndx)
+/*! Reads output of a tee stage. Output is copied into the tee stream and to the pipe target if this is
+  the last stage. Otherwise it is queued for the next stage.
+*/
+{
+    char buffer[0x10000];
+    stage *st = stages[ndx];
+    proc_pipes *pp = st->proc.pipes;
+    bool last = ndx+1 == stages.size();
+    ostream *pipe = process::pipe_global ? process::pipe_global : pipe_target;
+    ssize_t br;
+    do {
+        br = read(pp->fd_out[0], buffer, sizeof(buffer));
+    }while(br == -1 && errno == EINTR);
+    if(br > 0) {
+        pp->br_out += br;
+        st->tee->write(buffer, br);
+        if(last) {
+            if(pipe)
+                pipe->write(buffer, br);
+        }
+        else if(stages[ndx+1]->proc.pipes->fd_in[1])
+            st->pending.append(buffer, br);
+        return;
+    }
+    if(br == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    // End of output. Next stage gets end of file once the pending data has been written.
+    close(pp->fd_out[0]);
+    pp->fd_out[0] = 0;
+    if(!last && st->pending.empty())
+        stages[ndx+1]->proc.pipes->close_child_input();
+}
+
+// ==================================================================================================
+void c4s::pipeline::relay_flush(size_t ndx, short revents)
+/*! Writes pending tee'd data into next stage's input. Called when the input is writable.
+ */
+{
+    stage *st = stages[ndx];
+    proc_pipes *next = stages[ndx+1]->proc.pipes;
+    if(revents & (POLLERR|POLLHUP)) {
+        // Next stage does not read anymore.
+        st->pending.clear();
+        next->close_child_input();
+        return;
+    }
+    ssize_t bw = write(next->fd_in[1], st->pending.data(), st->pending.size());
+    if(bw > 0) {
+        next->br_in += bw;
+        st->pending.erase(0, bw);
+    }
+    else if(bw == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        st->pending.clear();
+        next->close_child_input();
+        return;
+    }
+    if(st->pending.empty() && !st->proc.pipes->fd_out[0])
+        next->close_child_input();
+}
+
+// ==================================================================================================
+int c4s::pipeline::wait_for_exit(std::chrono::milliseconds timeout)
+/*! If the timeout expires or the cancel token is cancelled, all stages are terminated and
+  process_exception is thrown.
+  \param timeout Time to wait.
+  \retval int Return value from the last stage.
+*/
+{
+    const size_t PFD_ERR=0, PFD_OUT=1, PFD_NEXT=2, PFD_PID=3, PFD_IN=4, PFD_COUNT=5;
+    std::vector<struct pollfd> pfd(stages.size()*PFD_COUNT+1);
+    ostream *pipe = process::pipe_global ? process::pipe_global : pipe_target;
+    long long now = process::now_ms();
+    long long deadline = now + timeout.count();
+
+    for(;;) {
+        bool running = false, tick = false;
+        for(size_t ndx=0; ndx<stages.size(); ndx++) {
+            stage *st = stages[ndx];
+            if(st->running && st->proc.reap()) {
+                st->rv = st->proc.last_ret_val;
+                st->running = false;
+                st->proc.close_pidfd();
+            }
+            if(st->running) {
+                running = true;
+                if(st->proc.pidfd<0)
+                    tick = true;
+            }
+        }
+        if(!running)
+            break;
+        if(now >= deadline) {
+            stop();
+            ostringstream os;
+            os << "pipeline::wait_for_exit - "<<stages.size()<<" stages; Process timeout!";
+            throw process_exception(os.str());
+        }
+        if(cancel && cancel->is_cancelled()) {
+            stop();
+            ostringstream os;
+            os << "pipeline::wait_for_exit - "<<stages.size()<<" stages; Process cancelled!";
+            throw process_exception(os.str());
+        }
+        for(size_t ndx=0; ndx<stages.size(); ndx++) {
+            stage *st = stages[ndx];
+            proc_pipes *pp = st->proc.pipes;
+            bool last = ndx+1 == stages.size();
+            struct pollfd *sp = &pfd[ndx*PFD_COUNT];
+            for(size_t i=0; i<PFD_COUNT; i++) {
+                sp[i].fd = -1;
+                sp[i].events = i==PFD_NEXT || i==PFD_IN ? POLLOUT : POLLIN;
+                sp[i].revents = 0;
+            }
+            if(!pp)
+                continue;
+            sp[PFD_ERR].fd = pp->get_fd_err();
+            if(st->tee && !last && !st->pending.empty())
+                sp[PFD_NEXT].fd = stages[ndx+1]->proc.pipes->fd_in[1] ? stages[ndx+1]->proc.pipes->fd_in[1] : -1;
+            else
+                sp[PFD_OUT].fd = pp->get_fd_out();
+            if(st->running)
+                sp[PFD_PID].fd = st->proc.pidfd;
+            if(ndx==0)
+                sp[PFD_IN].fd = pp->get_fd_in();
+        }
+        pfd.back().fd = cancel ? cancel->get_fd() : -1;
+        pfd.back().events = POLLIN;
+        pfd.back().revents = 0;
+        long long delay = deadline - now;
+        if(tick && delay>PROC_POLL_TICK)
+            delay = PROC_POLL_TICK;
+        if(poll(&pfd[0], pfd.size(), (int)delay) == -1 && errno != EINTR) {
+            ostringstream os;
+            os << "pipeline::wait_for_exit - poll error: "<<strerror(errno);
+            throw process_exception(os.str());
+        }
+        for(size_t ndx=0; ndx<stages.size(); ndx++) {
+            stage *st = stages[ndx];
+            proc_pipes *pp = st->proc.pipes;
+            struct pollfd *sp = &pfd[ndx*PFD_COUNT];
+            if(!pp)
+                continue;
+            if(sp[PFD_ERR].revents)
+                pp->read_child_stderr(pipe);
+            if(sp[PFD_OUT].revents) {
+                if(st->tee)
+                    relay(ndx);
+                else
+                    pp->read_child_stdout(pipe);
+            }
+            if(sp[PFD_NEXT].revents)
+                relay_flush(ndx, sp[PFD_NEXT].revents);
+            if(sp[PFD_IN].revents & (POLLERR|POLLHUP))
+                pp->close_child_input();
+            else if(sp[PFD_IN].revents)
+                pp->feed_child_input();
+            if(st->running)
+                st->proc.check_halt();
+        }
+        now = process::now_ms();
+    }
+
+    // All stages have exited. Collect the remaining output.
+    for(size_t ndx=0; ndx<stages.size(); ndx++) {
+        stage *st = stages[ndx];
+        proc_pipes *pp = st->proc.pipes;
+        if(!pp)
+            continue;
+        pp->read_child_stderr(pipe);
+        if(st->tee) {
+            while(pp->fd_out[0]) {
+                size_t before = pp->br_out;
+                relay(ndx);
+                if(pp->br_out == before)
+                    break;
+            }
+        }
+        else
+            pp->read_child_stdout(pipe);
+        st->pending.clear();
+        st->proc.pid = 0;
+        st->proc.stop();
+    }
+    return stages.back()->rv;
+}
+
+// ==================================================================================================
+void c4s::pipeline::stop()
+/*! Running stages are terminated. Resources of the exited stages are released.
+ */
+{
+    std::vector<process*> procs;
+    for(size_t ndx=0; ndx<stages.size(); ndx++) {
+        stage *st = stages[ndx];
+        if(!st->running)
+            st->proc.pid = 0;
+        procs.push_back(&st->proc);
+        st->running = false;
+        st->pending.clear();
+    }
+    process::stop_all(procs);
+}
@@ -0,0 +1,101 @@
+/*******************************************************************************
+c4s_pipeline.hpp
+Defines pipeline-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifndef C4S_PIPELINE_HPP
+#define C4S_PIPELINE_HPP
+
+#include <vector>
+
+namespace c4s {
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Chain of processes where each process' stdout is connected to next process' stdin. (Linux & OSX)
+    /*! Same as 'cmd1 | cmd2 | cmd3' in shell. Stages are connected directly with kernel pipes, i.e. the
+      data does not travel through the parent. All stages run at the same time. Stderr of every stage and
+      stdout of the last stage are piped to the pipeline's pipe target. Tee can be set for any stage in
+      which case the stage output is relayed through the parent and copied into the tee stream. Return
+      values of all stages are available after the run like bash PIPESTATUS.
+    */
+    class pipeline
+    {
+    public:
+        //! Creates an empty pipeline.
+        pipeline(ostream *out=0) { pipe_target = out; cancel = 0; }
+        //! Deletes the stages. Running stages are terminated.
+        ~pipeline();
+
+        //! Appends a new stage to the end of the pipeline. \retval size_t Index of the stage.
+        size_t add(const char *cmd, const char *args=0);
+        //! Appends a new stage to the end of the pipeline. \retval size_t Index of the stage.
+        size_t add(const string &cmd, const string &args);
+        //! Appends a new stage to the end of the pipeline. \retval size_t Index of the stage.
+        size_t add(const string &cmd, const std::vector<string> &argv);
+        //! Removes all stages.
+        void clear();
+        //! Returns the number of stages.
+        size_t size() { return stages.size(); }
+
+        //! Copies the output of the given stage into the target stream.
+        void tee(size_t ndx, ostream *target) { stages.at(ndx)->tee = target; }
+        //! Given file is fed to first stage's stdin. Replaces an input set with get_process(0).pipe_from.
+        void pipe_from(const path &from) { in_path = from; }
+        //! Pipes stderr of all stages and stdout of the last stage to given stream.
+        void pipe_to(ostream *out) { pipe_target = out; }
+        //! Returns access to stage's process e.g. for setting the user.
+        process& get_process(size_t ndx) { return stages.at(ndx)->proc; }
+        //! Wait is cancelled when the token is cancelled. Null removes the token.
+        void set_cancel(cancel_token *ct) { cancel = ct; }
+
+        //! Starts all stages.
+        void start();
+        //! Waits for all stages to end or until the timeout (seconds) expires.
+        int wait_for_exit(int timeout) { return wait_for_exit(std::chrono::seconds(timeout)); }
+        //! Waits for all stages to end or until the timeout expires.
+        int wait_for_exit(std::chrono::milliseconds timeout);
+        //! Runs the pipeline = calls start and waits for the exit.
+        int exec(int timeout=C4S_PROC_TIMEOUT) { start(); return wait_for_exit(timeout); }
+        //! Runs the pipeline = calls start and waits for the exit.
+        int exec(std::chrono::milliseconds timeout) { start(); return wait_for_exit(timeout); }
+        //! Runs the pipeline with given timeout.
+        int operator() (int timeout=C4S_PROC_TIMEOUT) { return exec(timeout); }
+        //! Terminates the running stages.
+        void stop();
+
+        //! Returns the return value of the given stage as given by process::last_return_value.
+        int get_return_value(size_t ndx) { return stages.at(ndx)->rv; }
+
+    protected:
+        struct stage {
+            process proc;
+            ostream *tee;       //!< Optional copy target for the stage output.
+            string pending;     //!< Tee'd output waiting to be written into next stage.
+            bool running;
+            int rv;
+        };
+        void relay(size_t ndx);
+        void relay_flush(size_t ndx, short revents);
+
+        std::vector<stage*> stages;
+        ostream *pipe_target;   //!< Target for stderr and the last stage stdout.
+        path in_path;           //!< Input file for the first stage.
+        cancel_token *cancel;   //!< If set, cancels the wait. See set_cancel.
+    };
+}
+#endif
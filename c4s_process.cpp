@@ -30,6 +30,20 @@ Copyright (c) Menacon Ltd, Finland
   #include <fcntl.h>
   #include <stdlib.h>
   #include <signal.h>
+  #include <poll.h>
+  #include <time.h>
+  #include <spawn.h>
+  #include <sys/resource.h>
+  #include <sys/uio.h>
+  #include <mutex>
+ #endif
+ #ifdef __linux
+  #include <sys/syscall.h>
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+  #include <dirent.h>
+  #include <stdio.h>
+  #include <sched.h>
  #endif
  #include "c4s_config.hpp"
  #include "c4s_exception.hpp"
@@ -37,15 +51,24 @@ Copyright (c) Menacon Ltd, Finland
  #include "c4s_path.hpp"
  #include "c4s_path_list.hpp"
  #include "c4s_compiled_file.hpp"
+ #if defined(__linux) || defined(__APPLE__)
+  #include "c4s_capture.hpp"
+ #endif
  #include "c4s_variables.hpp"
  #include "c4s_program_arguments.hpp"
  #include "c4s_process.hpp"
+ #ifdef __linux
+  #include "c4s_process_reactor.hpp"
+  #include "c4s_fork_server.hpp"
+ #endif
  #include "c4s_util.hpp"
  using namespace c4s;
 #endif
 
 #ifdef _WIN32
 const size_t MAX_ARG_BUFFER = 512;
+#else
+extern char **environ;
 #endif
 
 // ==================================================================================================
@@ -63,20 +86,20 @@ c4s::proc_pipes::proc_pipes()
     memset(fd_err,0,sizeof(fd_err));
     memset(fd_in,0,sizeof(fd_in));
 
-    if(pipe(fd_out))
+    if(!create_pipe(fd_out))
         throw process_exception("proc_pipes::proc_pipes - Unable to create pipe for the process std output.");
     if(fd_out[0]<3 || fd_out[1]<3) {
 //#ifdef _DEBUG
 //        cerr << "WARNING - Pipe allocation over standard streams !\n";
 //#endif
-        if(pipe(fd_tmp))
+        if(!create_pipe(fd_tmp))
             throw process_exception("proc_pipes::proc_pipes - Unable to create pipe for the process std output (2).");
         fd_out[0] = fd_tmp[0];
         fd_out[1] = fd_tmp[1];
     }
-    if(pipe(fd_err))
+    if(!create_pipe(fd_err))
         throw process_exception("proc_pipes::proc_pipes - Unable to create pipe for the process std error.");
-    if(pipe(fd_in))
+    if(!create_pipe(fd_in))
         throw process_exception("proc_pipes::proc_pipes - Unable to create pipe for the process std input.");
 
     // Make out and err read pipes nonblocking
@@ -93,12 +116,25 @@ c4s::proc_pipes::proc_pipes()
     br_err = 0;
     br_in  = 0;
     send_ctrlZ = false;
+#if defined(__linux) || defined(__APPLE__)
+    fd_src = 0;
+    src_offset = 0;
+    use_splice = true;
+    cap_out = 0;
+    cap_err = 0;
+    hnd_out = 0;
+    hnd_err = 0;
+#endif
 }
 
 // ==================================================================================================
 void c4s::proc_pipes::close_child_input()
 {
 #if defined(__linux) || defined(__APPLE__)
+    if(fd_src) {
+        close(fd_src);
+        fd_src = 0;
+    }
     if(fd_in[0]) {
         close(fd_in[0]);
         fd_in[0] = 0;
@@ -227,6 +263,7 @@ c4s::proc_pipes::~proc_pipes()
     if(fd_err[1]) close(fd_err[1]);
     if(fd_in[0]) close(fd_in[0]);
     if(fd_in[1]) close(fd_in[1]);
+    if(fd_src) close(fd_src);
 #endif
 }
 
@@ -240,9 +277,9 @@ void c4s::proc_pipes::init_child()
   \retval bool True on succes, false on error.
 */
 {
-    close(fd_in[1]);
-    close(fd_out[0]);
-    close(fd_err[0]);
+    if(fd_in[1]) close(fd_in[1]);
+    if(fd_out[0]) close(fd_out[0]);
+    if(fd_err[0]) close(fd_err[0]);
     dup2(fd_in[0],STDIN_FILENO); // = 0
     dup2(fd_out[1],STDOUT_FILENO); // = 1
     dup2(fd_err[1],STDERR_FILENO); // = 2
@@ -255,6 +292,75 @@ void c4s::proc_pipes::init_child()
 }
 #endif
 
+// ==================================================================================================
+#if defined(__linux) || defined(__APPLE__)
+void c4s::proc_pipes::init_child(posix_spawn_file_actions_t *actions)
+/*!
+  Records the child side pipe initialization into spawn file actions. The actions are the same that
+  init_child() performs after fork. Parent side is initialized normally with init_parent after the spawn.
+  \param actions Initialized file actions for posix_spawn.
+*/
+{
+    if(fd_in[1]) posix_spawn_file_actions_addclose(actions, fd_in[1]);
+    if(fd_out[0]) posix_spawn_file_actions_addclose(actions, fd_out[0]);
+    if(fd_err[0]) posix_spawn_file_actions_addclose(actions, fd_err[0]);
+    posix_spawn_file_actions_adddup2(actions, fd_in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(actions, fd_out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(actions, fd_err[1], STDERR_FILENO);
+    posix_spawn_file_actions_addclose(actions, fd_in[0]);
+    posix_spawn_file_actions_addclose(actions, fd_out[1]);
+    posix_spawn_file_actions_addclose(actions, fd_err[1]);
+}
+#endif
+
+// ==================================================================================================
+#if defined(__linux) || defined(__APPLE__)
+bool c4s::proc_pipes::create_pipe(int *fds)
+/*!
+  Creates a pipe with close-on-exec flag set for both ends. Children inherit only the ends that are
+  duplicated to their standard streams. Otherwise concurrently running children would hold each
+  other's pipes open.
+  \param fds Array of two descriptors for the pipe.
+  \retval bool True on success.
+*/
+{
+    if(pipe(fds))
+        return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+#endif
+
+// ==================================================================================================
+#if defined(__linux) || defined(__APPLE__)
+void c4s::proc_pipes::redirect(int *fd_pipe, int fd)
+/*!
+  Replaces the given child output pipe with a file descriptor. Child writes directly to the file and
+  parent does not read the stream at all. This object takes the ownership of the descriptor.
+  \param fd_pipe Either fd_out or fd_err.
+  \param fd Open file descriptor.
+*/
+{
+    if(fd_pipe[0]) close(fd_pipe[0]);
+    if(fd_pipe[1]) close(fd_pipe[1]);
+    fd_pipe[0] = 0;
+    fd_pipe[1] = fd;
+}
+
+// ==================================================================================================
+void c4s::proc_pipes::redirect_input(int fd)
+/*!
+  Replaces the child input pipe with a file descriptor. Child reads directly from the descriptor and
+  parent cannot write to child's input. This object takes the ownership of the descriptor.
+  \param fd Open file descriptor.
+*/
+{
+    close_child_input();
+    fd_in[0] = fd;
+}
+#endif
+
 // ==================================================================================================
 #if defined(__linux) || defined(__APPLE__)
 void c4s::proc_pipes::init_parent()
@@ -294,20 +400,115 @@ void c4s::proc_pipes::init(STARTUPINFO *info, HANDLE *waits)
 }
 #endif
 
+// ==================================================================================================
+#if defined(__linux) || defined(__APPLE__)
+void c4s::proc_pipes::set_capacity(size_t size)
+/*!
+  Larger pipes let a verbose child run ahead while the parent is busy elsewhere. Unprivileged processes
+  are limited by /proc/sys/fs/pipe-max-size, so the size is halved until the kernel accepts it. Drain
+  reads the whole pipe with one readv. Does nothing on OSX.
+  \param size Requested capacity in bytes. Limited to PROC_MAX_PIPE_SIZE.
+*/
+{
+#ifdef F_SETPIPE_SZ
+    if(size > PROC_MAX_PIPE_SIZE)
+        size = PROC_MAX_PIPE_SIZE;
+    int *fds[2] = { fd_out, fd_err };
+    pipe_stats *sts[2] = { &st_out, &st_err };
+    size_t largest = 0;
+    for(int ndx=0; ndx<2; ndx++) {
+        if(!fds[ndx][0])
+            continue;  // Redirected.
+        size_t try_size = size;
+        int rv;
+        while((rv = fcntl(fds[ndx][0], F_SETPIPE_SZ, (int)try_size)) == -1 && errno == EPERM && try_size > 0x10000)
+            try_size /= 2;
+        if(rv > 0) {
+            sts[ndx]->capacity = rv;
+            if((size_t)rv > largest)
+                largest = rv;
+        }
+    }
+    if(largest > 0x10000)
+        big_buffer.resize(largest - 0x10000);
+#endif
+}
+
+// ==================================================================================================
+size_t c4s::proc_pipes::drain(int &fd, ostream *pout, output_handler *oh, pipe_stats &st)
+/*!
+  Reads the given nonblocking pipe until it is empty. If the write end has been closed by the child
+  (i.e. end of file) the read end is closed and the descriptor is set to zero. Read goes into a stack
+  buffer and, for pipes enlarged with set_capacity, continues into big_buffer in the same readv.
+  \param fd Read end of the pipe.
+  \param pout Stream for the output. May be null in which case the data is discarded.
+  \param oh Output handler. If given, the data is passed to it instead of the stream.
+  \param st Counters for the stream.
+  \retval size_t Number of bytes read.
+*/
+{
+    char buffer[0x10000];
+    struct iovec iov[2];
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = sizeof(buffer);
+    iov[1].iov_base = big_buffer.empty() ? 0 : &big_buffer[0];
+    iov[1].iov_len = big_buffer.size();
+    int iov_count = big_buffer.empty() ? 1 : 2;
+    size_t room = sizeof(buffer) + big_buffer.size();
+    size_t total=0;
+    ssize_t rsize;
+    while(fd) {
+        rsize = readv(fd, iov, iov_count);
+        if(rsize>0) {
+            size_t first = (size_t)rsize < sizeof(buffer) ? rsize : sizeof(buffer);
+            if(oh) {
+                oh->feed(buffer, first);
+                if((size_t)rsize > first)
+                    oh->feed(&big_buffer[0], rsize-first);
+            }
+            else if(pout) {
+                pout->write(buffer, first);
+                if((size_t)rsize > first)
+                    pout->write(&big_buffer[0], rsize-first);
+            }
+            st.last_read = process::now_ms();
+            if(!st.reads)
+                st.first_read = st.last_read;
+            st.reads++;
+            st.bytes += rsize;
+            if((size_t)rsize == room)
+                st.full_reads++;
+            if((size_t)rsize > st.max_read)
+                st.max_read = rsize;
+            total += rsize;
+            continue;
+        }
+        if(rsize<0 && errno==EINTR)
+            continue;
+        if(rsize==0 || (errno!=EAGAIN && errno!=EWOULDBLOCK)) {
+            if(oh)
+                oh->flush();
+            close(fd);
+            fd = 0;
+        }
+        break;
+    }
+    return total;
+}
+#endif
+
 // ==================================================================================================
 void c4s::proc_pipes::read_child_stdout(ostream *pout)
 /*!
-  Read both stdout from the child process and print it out on the given stream.
+  Reads all currently available stdout from the child process and prints it out on the given stream.
   \param pout Stream for the output
 */
 {
 #if defined(__linux) || defined(__APPLE__)
-    char out_buffer[512];
-    ssize_t rsize = read(fd_out[0],out_buffer,sizeof(out_buffer));
-    if(rsize>0 && pout) {
-        pout->write(out_buffer,rsize);
-    }
-    br_out+=rsize;
+    if(cap_out)
+        br_out += cap_out->read_from(fd_out[0]);
+    else
+        br_out += drain(fd_out[0],pout,hnd_out,st_out);
 #else
     out.read(pout);
 #endif
@@ -316,17 +517,15 @@ void c4s::proc_pipes::read_child_stdout(ostream *pout)
 // ==================================================================================================
 void c4s::proc_pipes::read_child_stderr(ostream *pout)
 /*!
-  Read both stdout and stderr from the child process and print it out on the given stream.
+  Reads all currently available stderr from the child process and prints it out on the given stream.
   \param pout Stream for the output
 */
 {
 #if defined(__linux) || defined(__APPLE__)
-    char out_buffer[512];
-    ssize_t rsize = read(fd_err[0],out_buffer,sizeof(out_buffer));
-    if(rsize>0 && pout) {
-        pout->write(out_buffer,rsize);
-    }
-    br_err+=rsize;
+    if(cap_err)
+        br_err += cap_err->read_from(fd_err[0]);
+    else
+        br_err += drain(fd_err[0],pout,hnd_err,st_err);
 #else
     err.read(pout);
 #endif
@@ -355,35 +554,129 @@ size_t c4s::proc_pipes::read_child_stdin(ostream *pout)
 #endif
 
 // ==================================================================================================
-size_t c4s::proc_pipes::write_child_input(const path &pin)
+#if defined(__linux) || defined(__APPLE__)
+void c4s::proc_pipes::open_child_input(const path &pin)
 /*!
-  Writes the given string into the child input.
-  \param input String to write.
+  Opens the given file as a source for the child input. Content is moved into the child's stdin with
+  feed_child_input whenever the pipe has room. Input pipe is made nonblocking.
+  \param pin Path to the input file.
 */
 {
-    char buffer[1024];
-    size_t cnt=0;
 #ifdef C4S_DEBUGTRACE
-    cerr << "proc_pipes::write_child_input - Feeding '"<<pin.get_path()<<"' to child input\n";
+    cerr << "proc_pipes::open_child_input - Feeding '"<<pin.get_path()<<"' to child input\n";
 #endif
-#if defined(__linux) || defined(__APPLE__)
-    streamsize ss;
-    ifstream input(pin.get_path().c_str());
-    if(!input) {
+    if(fd_src)
+        close(fd_src);
+    fd_src = open(pin.get_path().c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd_src == -1) {
+        fd_src = 0;
         ostringstream os;
-        os << "proc_pipes::write_child_input - Unable to open input file:"<<pin.get_path()<<" for the child stdin.";
+        os << "proc_pipes::open_child_input - Unable to open input file:"<<pin.get_path()<<" for the child stdin.";
         throw process_exception(os.str());
     }
-    do {
-        input.read(buffer,sizeof(buffer));
-        ss = input.gcount();
-        if(ss>0) {
-            write(fd_in[1],buffer,ss);
-            cnt+=ss;
+    src_offset = 0;
+    int fflag = fcntl(fd_in[1], F_GETFL, 0);
+    fcntl(fd_in[1], F_SETFL, fflag|O_NONBLOCK);
+}
+
+// ==================================================================================================
+size_t c4s::proc_pipes::feed_child_input()
+/*!
+  Moves input file content into the child's stdin until the pipe is full or the file ends. In Linux the
+  data is moved with splice without copying it through the parent. Read-write loop is used if splice is
+  not supported for the file. At the end of file the child input is closed. If the child exits without
+  reading all of its input the input is closed as well. SIGPIPE is blocked during the feed.
+  \retval size_t Number of bytes written.
+*/
+{
+    size_t cnt=0;
+    ssize_t bw;
+    // Block SIGPIPE so that a child that has closed its input gives EPIPE instead of killing this process.
+    sigset_t pipe_set, old_set, pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    sigpending(&pending);
+    bool was_pending = sigismember(&pending, SIGPIPE);
+    bool broken = false;
+    while(fd_src) {
+#ifdef __linux
+        if(use_splice) {
+            bw = splice(fd_src, &src_offset, fd_in[1], 0, 0x100000, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if(bw == -1 && errno == EINVAL) {
+                use_splice = false;
+                continue;
+            }
+        }
+        else
+#endif
+        {
+            char buffer[0x10000];
+            bw = pread(fd_src, buffer, sizeof(buffer), src_offset);
+            if(bw > 0) {
+                // Short write leaves the rest to be read again from the offset.
+                bw = write(fd_in[1], buffer, bw);
+                if(bw > 0)
+                    src_offset += bw;
+            }
+        }
+        if(bw > 0) {
+            cnt += bw;
+            continue;
+        }
+        if(bw == -1 && errno == EINTR)
+            continue;
+        if(bw == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        // End of file or error, e.g. child has closed its input.
+        if(bw == -1 && errno == EPIPE)
+            broken = true;
+#ifdef C4S_DEBUGTRACE
+        if(bw == -1)
+            cerr << "proc_pipes::feed_child_input - "<<strerror(errno)<<'\n';
+#endif
+        close_child_input();
+    }
+    // Consume the SIGPIPE raised by the failed write before the mask is restored.
+    if(broken && !was_pending && !sigismember(&old_set, SIGPIPE)) {
+        sigpending(&pending);
+        int sig;
+        if(sigismember(&pending, SIGPIPE))
+            sigwait(&pipe_set, &sig);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, 0);
+    br_in += cnt;
+    return cnt;
+}
+#endif
+
+// ==================================================================================================
+size_t c4s::proc_pipes::write_child_input(const path &pin)
+/*!
+  Writes the given file into the child input and closes the input. Function blocks until the child has
+  read the whole file. Process-class feeds the input from its wait loop instead.
+  \param pin Path to the input file.
+  \retval size_t Number of bytes written.
+*/
+{
+    size_t cnt=0;
+#if defined(__linux) || defined(__APPLE__)
+    struct pollfd pfd;
+    open_child_input(pin);
+    while(fd_src) {
+        cnt += feed_child_input();
+        if(fd_src) {
+            pfd.fd = fd_in[1];
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            poll(&pfd, 1, -1);
         }
-    }while( ss>0 && input.good() );
-    input.close();
+    }
 #else
+    char buffer[1024];
+#ifdef C4S_DEBUGTRACE
+    cerr << "proc_pipes::write_child_input - Feeding '"<<pin.get_path()<<"' to child input\n";
+#endif
     HANDLE hin = CreateFile(pin.get_path().c_str(),GENERIC_READ,FILE_SHARE_READ,0,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,0);
     if(hin == INVALID_HANDLE_VALUE) {
         ostringstream os;
@@ -436,11 +729,280 @@ void c4s::proc_pipes::write_child_input(const string &input)
     send_ctrlZ = true;
 }
 
+#if defined(__linux) || defined(__APPLE__)
+// ==================================================================================================
+// ###############################  CANCEL_TOKEN  ###################################################
+// ==================================================================================================
+c4s::cancel_token::cancel_token()
+{
+    cancelled = false;
+#ifdef __linux
+    fd[0] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    fd[1] = -1;
+    if(fd[0] == -1)
+#else
+    if(pipe(fd) == -1)
+#endif
+    {
+        ostringstream os;
+        os << "cancel_token - Unable to create the wake-up descriptor: "<<strerror(errno);
+        throw process_exception(os.str());
+    }
+#ifndef __linux
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+#endif
+}
+
+// ==================================================================================================
+c4s::cancel_token::~cancel_token()
+{
+    close(fd[0]);
+    if(fd[1]>=0)
+        close(fd[1]);
+}
+
+// ==================================================================================================
+void c4s::cancel_token::cancel()
+/*! Descriptor is left readable so that every poll using the token wakes up.
+ */
+{
+    if(cancelled.exchange(true))
+        return;
+#ifdef __linux
+    uint64_t one = 1;
+    if(write(fd[0], &one, sizeof(one)) == -1)
+#else
+    if(write(fd[1], "c", 1) == -1)
+#endif
+        cerr << "cancel_token::cancel - Unable to wake the waits: "<<strerror(errno)<<'\n';
+}
+
+// ==================================================================================================
+void c4s::cancel_token::reset()
+{
+    char buffer[64];
+    while(read(fd[0], buffer, sizeof(buffer)) > 0)
+        ;
+    cancelled = false;
+}
+
+// ==================================================================================================
+// ###############################  PROC_CONTROLS  ##################################################
+// ==================================================================================================
+void c4s::proc_controls::clear()
+{
+    nice = 0;
+    use_nice = false;
+    ioprio = 0;
+    use_affinity = false;
+    memset(cpu_mask, 0, sizeof(cpu_mask));
+    limit_count = 0;
+}
+
+// ==================================================================================================
+void c4s::proc_controls::add_cpu(int cpu)
+{
+    if(cpu<0 || cpu>=PROC_MAX_CPUS) {
+        ostringstream os;
+        os << "proc_controls::add_cpu - CPU number "<<cpu<<" is out of range.";
+        throw process_exception(os.str());
+    }
+    cpu_mask[cpu/64] |= 1ULL<<(cpu%64);
+    use_affinity = true;
+}
+
+// ==================================================================================================
+void c4s::proc_controls::set_rlimit(int resource, unsigned long long soft, unsigned long long hard)
+/*! Earlier limit for the same resource is replaced.
+ */
+{
+    int ndx;
+    for(ndx=0; ndx<limit_count; ndx++) {
+        if(limits[ndx].resource == resource)
+            break;
+    }
+    if(ndx == PROC_MAX_LIMITS)
+        throw process_exception("proc_controls::set_rlimit - Too many limits.");
+    limits[ndx].resource = resource;
+    limits[ndx].soft = soft;
+    limits[ndx].hard = hard;
+    if(ndx == limit_count)
+        limit_count++;
+}
+
+// ==================================================================================================
+int c4s::proc_controls::apply() const
+/*! Called in the child after fork. Uses only system calls i.e. no memory allocation or locks. Nice value
+  is set last so that a raised priority does not affect the other settings.
+  \retval int Zero on success, otherwise errno of the failed call.
+*/
+{
+    for(int ndx=0; ndx<limit_count; ndx++) {
+        struct rlimit rl;
+        rl.rlim_cur = (rlim_t)limits[ndx].soft;
+        rl.rlim_max = (rlim_t)limits[ndx].hard;
+        if(setrlimit(limits[ndx].resource, &rl) == -1)
+            return errno;
+    }
+#ifdef __linux
+    // IOPRIO_WHO_PROCESS = 1. Glibc has no wrapper.
+    if(ioprio && syscall(SYS_ioprio_set, 1, 0, ioprio) == -1)
+        return errno;
+    if(use_affinity) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(int cpu=0; cpu<PROC_MAX_CPUS && cpu<CPU_SETSIZE; cpu++) {
+            if(cpu_mask[cpu/64] & (1ULL<<(cpu%64)))
+                CPU_SET(cpu, &set);
+        }
+        if(sched_setaffinity(0, sizeof(set), &set) == -1)
+            return errno;
+    }
+#endif
+    if(use_nice && setpriority(PRIO_PROCESS, 0, nice) == -1)
+        return errno;
+    return 0;
+}
+
+// ==================================================================================================
+// ###############################  PROC_USAGE  #####################################################
+// ==================================================================================================
+void c4s::proc_usage::clear()
+{
+    start_time = 0;
+    end_time = 0;
+    user_time = 0;
+    sys_time = 0;
+    max_rss = 0;
+    minor_faults = 0;
+    major_faults = 0;
+    vol_switches = 0;
+    invol_switches = 0;
+    count = 0;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::proc_usage::add(const proc_usage &pu)
+/*! Wall times are summed by adding the other's elapsed time to end time.
+ */
+{
+    end_time += pu.end_time - pu.start_time;
+    user_time += pu.user_time;
+    sys_time += pu.sys_time;
+    if(pu.max_rss > max_rss)
+        max_rss = pu.max_rss;
+    minor_faults += pu.minor_faults;
+    major_faults += pu.major_faults;
+    vol_switches += pu.vol_switches;
+    invol_switches += pu.invol_switches;
+    count += pu.count;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::proc_usage::dump(ostream &os) const
+{
+    os << "wall="<<wall()<<"s; user="<<user_time<<"s; sys="<<sys_time<<"s; maxrss="<<max_rss;
+    os << "; faults="<<minor_faults<<'/'<<major_faults<<"; switches="<<vol_switches<<'/'<<invol_switches;
+    if(count != 1)
+        os << "; processes="<<count;
+    os << '\n';
+}
+
+// ==================================================================================================
+// ###############################  PIPE_STATS  #####################################################
+// ==================================================================================================
+void c4s::pipe_stats::clear()
+{
+    bytes = 0;
+    reads = 0;
+    full_reads = 0;
+    max_read = 0;
+    capacity = 0;
+    first_read = 0;
+    last_read = 0;
+}
+// ------------------------------------------------------------------------------------------
+double c4s::pipe_stats::rate() const
+/*! Rate is zero until there have been reads at least one millisecond apart.
+ */
+{
+    if(last_read <= first_read)
+        return 0;
+    return bytes*1000.0/(last_read-first_read);
+}
+// ------------------------------------------------------------------------------------------
+void c4s::pipe_stats::dump(ostream &os) const
+{
+    os << "bytes="<<bytes<<"; reads="<<reads<<"; full="<<full_reads<<"; max="<<max_read;
+    if(capacity)
+        os << "; pipe="<<capacity;
+    os << "; rate="<<(unsigned long long)rate()<<"B/s\n";
+}
+
+// ==================================================================================================
+// ###############################  OUTPUT_HANDLER  #################################################
+// ==================================================================================================
+bool c4s::output_handler::feed(const char *data, size_t len)
+/*! Complete lines are passed directly from the read buffer. Only a line that continues in the next read
+  is copied into the partial buffer. After the function has returned false the rest of output is discarded.
+*/
+{
+    if(halted)
+        return false;
+    if(!lines) {
+        if(!fn(data, len))
+            halted = true;
+        return !halted;
+    }
+    const char *end = data+len;
+    while(data < end) {
+        const char *nl = (const char*)memchr(data, '\n', end-data);
+        if(!nl) {
+            partial.append(data, end-data);
+            break;
+        }
+        bool ok;
+        if(partial.empty())
+            ok = fn(data, nl-data);
+        else {
+            partial.append(data, nl-data);
+            ok = fn(partial.data(), partial.size());
+            partial.clear();
+        }
+        if(!ok) {
+            halted = true;
+            partial.clear();
+            return false;
+        }
+        data = nl+1;
+    }
+    return true;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::output_handler::flush()
+{
+    if(lines && !halted && !partial.empty()) {
+        if(!fn(partial.data(), partial.size()))
+            halted = true;
+    }
+    partial.clear();
+}
+#endif
+
 // ==================================================================================================
 // ###############################  PROCESS  ########################################################
 // ==================================================================================================
 bool c4s::process::no_run = false;
 bool c4s::process::nzrv_exception = false;  //!< If true 'Non-Zero Return Value' causes exception.
+#if defined(__linux) || defined(__APPLE__)
+c4s::PROC_LAUNCH c4s::process::default_launch = c4s::PROC_LAUNCH::SPAWN;
+size_t c4s::process::default_pipe_size = 0;
+std::map<string,string> c4s::process::command_cache;
+string c4s::process::command_cache_env;
+static std::mutex command_lock;   // Guards command_cache and command_cache_env.
+c4s::proc_usage c4s::process::total_usage;
+static std::mutex usage_lock;   // Children are reaped by the reactor thread as well.
+#endif
 ofstream* c4s::process::pipe_global = 0;
 
 // ==================================================================================================
@@ -453,9 +1015,26 @@ void c4s::process::init_member_vars()
     pipe_target = 0;
     pipes = 0;
     echo = false;
+    use_argv = false;
 #if defined(__linux) || defined(__APPLE__)
     owner = 0;
     daemon = false;
+    pidfd = -1;
+    reaper_ticket = 0;
+    pipe_size = 0;
+    launch = default_launch;
+    redir_append_out = false;
+    redir_append_err = false;
+    redir_both = false;
+    link_in = -1;
+    link_out = -1;
+    argv_dirty = true;
+    cap_out = 0;
+    cap_err = 0;
+    halt_sent = false;
+    cancel = 0;
+    group = PROC_GROUP::INHERIT;
+    grace = std::chrono::milliseconds(C4S_PROC_GRACE);
 #else
     output = 0;
 #endif
@@ -539,7 +1118,10 @@ c4s::process::~process()
     if(pid)
 #endif
         stop();
-
+#if defined(__linux) || defined(__APPLE__)
+    release_child();
+    close_pidfd();
+#endif
     if(pipes) {
         delete pipes;
         pipes = 0;
@@ -563,7 +1145,7 @@ void c4s::process::set_command(const char *cmd)
     if( stat(command.get_path().c_str(),&sbuf) == -1 ||  !has_anybits(sbuf.st_mode, S_IXUSR|S_IXGRP|S_IXOTH) )
     {
         // cerr << "DEBUG - set_command:"<<command.get_path()<<"; st_mode="<<hex<<sbuf.st_mode<<dec<<'\n';
-        if(!command.exists_in_env_path("PATH",true))
+        if(!find_in_path(command))
         {
             ostringstream ss;
             command.clear();
@@ -602,24 +1184,61 @@ void c4s::process::operator=(const process &source)
     command = source.command;
     arguments.str("");
     arguments<<source.arguments.str();
+    argv_list = source.argv_list;
+    use_argv = source.use_argv;
     pid = 0;
     pipe_target = source.pipe_target;
 #if defined(__linux) || defined(__APPLE__)
+    pidfd = -1;
+    reaper_ticket = 0;
+    argv_dirty = true;
     daemon = source.daemon;
+    launch = source.launch;
+    redir_out = source.redir_out;
+    redir_err = source.redir_err;
+    redir_append_out = source.redir_append_out;
+    redir_append_err = source.redir_append_err;
+    redir_both = source.redir_both;
+    cancel = source.cancel;
+    group = source.group;
+    grace = source.grace;
+    controls = source.controls;
+    pipe_size = source.pipe_size;
 #else
     output = 0;
 #endif
 }
 
 // ### \TODO continue to improve documentation from here on down.
+// ==================================================================================================
+void c4s::process::print_args(ostream &os) const
+/*! Prints the arguments. Items of the argument vector are quoted.
+ */
+{
+    if(use_argv) {
+        for(std::vector<string>::const_iterator ai=argv_list.begin(); ai!=argv_list.end(); ai++) {
+            if(ai!=argv_list.begin()) os << ' ';
+            os << '\''<<*ai<<'\'';
+        }
+    }
+    else
+        os << arguments.str();
+}
+
 // ==================================================================================================
 void c4s::process::dump(ostream &os)
 {
     const char *pe = echo ? "true":"false";
     const char *pt = pipe_target ? "OK":"None";
     os << "Process - "<<command.get_path()<<"(";
-    os << arguments.str();
+    print_args(os);
     os << ");\n   PID="<<pid<<"; echo="<<pe<<"; LRV="<<last_ret_val<<"; PT="<<pt<<'\n';
+#if defined(__linux) || defined(__APPLE__)
+    if(usage.count) {
+        os << "   ";
+        usage.dump(os);
+    }
+#endif
 }
 
 // ==================================================================================================
@@ -635,6 +1254,21 @@ void c4s::process::start(const char *args)
         throw process_exception("process::start - Unable to start process. No command specified.");
     if(pid)
         stop();
+    string joined;
+    if(use_argv && !args) {
+        for(std::vector<string>::iterator ai=argv_list.begin(); ai!=argv_list.end(); ai++) {
+            if(!joined.empty())
+                joined += ' ';
+            if(ai->empty() || ai->find(' ')!=string::npos) {
+                joined += '\"';
+                joined += *ai;
+                joined += '\"';
+            }
+            else
+                joined += *ai;
+        }
+        args = joined.c_str();
+    }
     streamsize max=command.get_path().size();
     if(!args)
         max += arguments.tellg();
@@ -692,95 +1326,27 @@ void c4s::process::start(const char *args)
 #if defined(__linux) || defined(__APPLE__)
 void c4s::process::start(const char *args)
 {
-    streamsize max;
-    char tmp_argbuf[512];
-    char tmp_cmdbuf[128];
-    char *arg_buffer, *dynamic_buffer=0;
-    const char *arg_ptr[MAX_PROCESS_ARGS];
-    int ptr_count;
-
     if(command.empty())
         throw process_exception("process::start - Unable to start process. No command specified.");
 
     if(pid)
         stop();
-    if(args) {
-        arguments.str("");
-        arguments << args;
-    }
+    if(args)
+        set_args(args);
     last_ret_val = 0;
     if(no_run)
         return;
+    reap_all();
 
-    memset(arg_ptr,0,sizeof(arg_ptr));
-    // convention requires the first argument to be the path to command itself
-    strcpy(tmp_cmdbuf,command.get_path().c_str());
-    arg_ptr[0] = tmp_cmdbuf;
-    ptr_count = 1;
-    // These need to be in *argv[]. Copy from argumetn streamd to static buffer and
-    // change spaces to zeros and at the same time make pointers to args.
-    max = arguments.tellp();
-    if(max>0) {
-        size_t arg_buffer_length = max;
-        if(arg_buffer_length > sizeof(tmp_argbuf)) {
-            dynamic_buffer = new char[arg_buffer_length+1];
-            arg_buffer = dynamic_buffer;
-            arg_buffer_length++;
-        }else{
-            arg_buffer = tmp_argbuf;
-            arg_buffer_length = sizeof(tmp_argbuf);
-        }
-        memset(arg_buffer,0,arg_buffer_length);
-        arg_ptr[ptr_count++] = arg_buffer;
-
-        int ch, prev=' ', quote=0;
-        stringbuf *argsb = arguments.rdbuf();
-        argsb->pubseekpos(0,ios_base::in);
-        for(ch=argsb->sgetc(); ch!=EOF && max>0; ch=argsb->snextc()){
-            if(quote) {
-                if(quote==ch) {
-                    if(prev!='\\')
-                        quote = 0;
-                    else
-                        arg_buffer--;
-                }
-                else
-                    *arg_buffer++=(char)(ch&0xff);
-            }
-            else if(ch == '\'' || ch == '\"') {
-                if (prev=='\\')
-                    *(arg_buffer-1)=(char)(ch&0xff);
-                else
-                    quote = ch;
-            }
-            else if(ch == ' ') {
-                if(prev!=' ') {
-                    *arg_buffer++=0;
-                    arg_ptr[ptr_count++] = arg_buffer;
-                    if(ptr_count >= MAX_PROCESS_ARGS-1)
-                        throw process_exception("process::start - Too many arguments. Use response file.");
-                }
-            }
-            else
-                *arg_buffer++=(char)(ch&0xff);
-            prev=ch;
-            max--;
-        }
-        *arg_buffer = 0;
-        if(quote)
-            throw process_exception("process::start - Unmatched quote marks in arguments.");
-    } // if arguments.tellp()
-    else {
-        arg_buffer = 0;
-    }
-
-    // Finalize argument pointer array
-    arg_ptr[ptr_count] = 0;
-    if(arg_ptr[ptr_count-1][0]==0)
-        arg_ptr[ptr_count-1]=0;
+    build_argv();
+    char **arg_ptr = &argv_ptr[0];
+    struct timespec ts_start;
+    clock_gettime(CLOCK_REALTIME,&ts_start);
+    usage.clear();
+    usage.start_time = ts_start.tv_sec*1000LL + ts_start.tv_nsec/1000000;
 
 #ifdef C4S_DEBUGTRACE
-    cerr << "process::start - "<<command.get_path()<<'('<<tmp_cmdbuf<<"):\n";
+    cerr << "process::start - "<<command.get_path()<<'('<<arg_ptr[0]<<"):\n";
     for(int i=0; arg_ptr[i]; i++)
         cerr << " ["<<i<<"] "<<arg_ptr[i]<<'\n';
     cerr << "process::start - About to fork, pipe=";
@@ -803,40 +1369,257 @@ void c4s::process::start(const char *args)
     if(pipes)
         delete pipes;
     pipes = new proc_pipes();
-
-    // Create the child process i.e. fork
-    pid = fork();
-    if(!pid) {
+    pipes->cap_out = cap_out;
+    pipes->cap_err = cap_err;
+    out_handler.reset();
+    err_handler.reset();
+    halt_sent = false;
+    if(out_handler.fn)
+        pipes->hnd_out = &out_handler;
+    if(err_handler.fn)
+        pipes->hnd_err = &err_handler;
+    if(!redir_out.empty()) {
+        int fd = open_redirect(redir_out, redir_append_out);
+        pipes->redirect(pipes->fd_out, fd);
+        if(redir_both) {
+            // Both streams share the same open file i.e. the same offset as in shell '2>&1'.
+            pipes->redirect(pipes->fd_err, fcntl(fd, F_DUPFD_CLOEXEC, 3));
+        }
+    }
+    if(!redir_both && !redir_err.empty())
+        pipes->redirect(pipes->fd_err, open_redirect(redir_err, redir_append_err));
+    // Pipeline links the stages with kernel pipes.
+    if(link_in >= 0) {
+        pipes->redirect_input(link_in);
+        link_in = -1;
+    }
+    if(link_out >= 0) {
+        pipes->redirect(pipes->fd_out, link_out);
+        link_out = -1;
+    }
+    size_t ps = pipe_size ? pipe_size : default_pipe_size;
+    if(ps)
+        pipes->set_capacity(ps);
+    stats_out.clear();
+    stats_err.clear();
+
+    // Persona switch needs code between fork and exec. Hence spawn is used only without owner.
+    bool use_spawn = launch != PROC_LAUNCH::FORK && !owner && controls.empty();
+#ifndef POSIX_SPAWN_SETSID
+    if(group == PROC_GROUP::SESSION)
+        use_spawn = false;
+#endif
+#ifdef __linux
+    if(launch == PROC_LAUNCH::SERVER && !owner && fork_server::running()) {
+        pid = fork_server::spawn(arg_ptr, pipes->fd_in[0], pipes->fd_out[1], pipes->fd_err[1], group, &controls);
 #ifdef C4S_DEBUGTRACE
-        cerr << "process::start - created child: "<<getpid()<<endl;
+        cerr << "process::start - child from fork server: "<<pid<<endl;
 #endif
-        pipes->init_child();
-        delete pipes;
-        if(owner) {
-            if(initgroups(owner->get_name().c_str(),owner->get_gid())!=0 ||
-               setuid(owner->get_uid())!=0 ) {
-                int er = errno;
-                cerr << "process::start - child-process: Unable to change process persona. User:"<<owner->get_name()<<".\nError ("<<er<<") ";
-                cerr << strerror(er)<<'\n';
+    }
+    else
+#endif
+    if(use_spawn) {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+        pipes->init_child(&actions);
+        if(group == PROC_GROUP::GROUP) {
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+            posix_spawnattr_setpgroup(&attr, 0);
+        }
+#ifdef POSIX_SPAWN_SETSID
+        else if(group == PROC_GROUP::SESSION)
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#endif
+        int rv = posix_spawn(&pid, arg_ptr[0], &actions, &attr, arg_ptr, environ);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        if(rv) {
+            pid = 0;
+            ostringstream os;
+            os << "process::start - Unable to spawn process:"<<arg_ptr[0]<<". Error ("<<rv<<") "<<strerror(rv);
+            throw process_exception(os.str());
+        }
+#ifdef C4S_DEBUGTRACE
+        cerr << "process::start - spawned child: "<<pid<<endl;
+#endif
+    }
+    else {
+        // Create the child process i.e. fork
+        pid = fork();
+        if(pid == -1) {
+            pid = 0;
+            ostringstream os;
+            os << "process::start - Unable to fork process:"<<arg_ptr[0]<<". Error ("<<errno<<") "<<strerror(errno);
+            throw process_exception(os.str());
+        }
+        if(!pid) {
+#ifdef C4S_DEBUGTRACE
+            cerr << "process::start - created child: "<<getpid()<<endl;
+#endif
+            pipes->init_child();
+            delete pipes;
+            if(group == PROC_GROUP::GROUP)
+                setpgid(0, 0);
+            else if(group == PROC_GROUP::SESSION)
+                setsid();
+            int cer = controls.apply();
+            if(cer) {
+                cerr << "process::start - child-process: Unable to apply the process controls.\nError ("<<cer<<") ";
+                cerr << strerror(cer)<<'\n';
                 _exit(EXIT_FAILURE);
             }
+            if(owner) {
+                if(initgroups(owner->get_name().c_str(),owner->get_gid())!=0 ||
+                   setuid(owner->get_uid())!=0 ) {
+                    int er = errno;
+                    cerr << "process::start - child-process: Unable to change process persona. User:"<<owner->get_name()<<".\nError ("<<er<<") ";
+                    cerr << strerror(er)<<'\n';
+                    _exit(EXIT_FAILURE);
+                }
+            }
+            if(execv(arg_ptr[0],arg_ptr) == -1) {
+                cerr << "process::start - child-process: Unable to start process:"<<arg_ptr[0]<<"\nError ("<<errno<<") "<<strerror(errno)<<'\n';
+            }
+            _exit(EXIT_FAILURE);
         }
-        if(execv(tmp_cmdbuf,(char**)arg_ptr) == -1) {
-            cerr << "process::start - child-process: Unable to start process:"<<tmp_cmdbuf<<"\nError ("<<errno<<") "<<strerror(errno)<<'\n';
-        }
-        _exit(EXIT_FAILURE);
+        // Set the group here too so that stop can signal it even before the child has run.
+        if(group == PROC_GROUP::GROUP)
+            setpgid(pid, pid);
     }
     pipes->init_parent();
-    if(dynamic_buffer)
-        delete[] dynamic_buffer;
-    // If child input file has been defined, feed it to child.
-    if(!in_path.empty())
-        pipes->write_child_input(in_path);
+#if defined(__linux) && defined(SYS_pidfd_open)
+    // Kernels older than 5.3 do not support pidfd. wait_for_exit falls back to short poll intervals.
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    track_child();
+    // If child input file has been defined, start feeding it to child. wait_for_exit feeds the rest.
+    if(!in_path.empty() && pipes->fd_in[1]) {
+        pipes->open_child_input(in_path);
+        pipes->feed_child_input();
+    }
 }
 #endif // linux
 
 // ==================================================================================================
 #if defined(__linux) || defined(__APPLE__)
+bool c4s::process::find_in_path(path &cmd)
+/*! Searches the command from PATH. Resolved absolute paths are cached by command name. The cache is
+  cleared automatically when the PATH value changes. See refresh_command_cache.
+  \param cmd Command name. Set to full path of the command if found.
+  \retval bool True if the command was found.
+*/
+{
+    const char *env = getenv("PATH");
+    string name = cmd.get_path();
+    {
+        std::lock_guard<std::mutex> guard(command_lock);
+        if(!env || command_cache_env != env) {
+            command_cache.clear();
+            command_cache_env = env ? env : "";
+        }
+        std::map<string,string>::iterator ci = command_cache.find(name);
+        if(ci != command_cache.end()) {
+            cmd = ci->second;
+            return true;
+        }
+    }
+    if(!cmd.exists_in_env_path("PATH",true))
+        return false;
+    // Relative PATH entries depend on the current directory.
+    if(cmd.is_absolute()) {
+        std::lock_guard<std::mutex> guard(command_lock);
+        command_cache[name] = cmd.get_path();
+    }
+    return true;
+}
+
+// ==================================================================================================
+void c4s::process::refresh_command_cache()
+{
+    std::lock_guard<std::mutex> guard(command_lock);
+    command_cache.clear();
+}
+
+// ==================================================================================================
+void c4s::process::build_argv()
+/*! Builds the argument vector for exec from the command and either the argument vector or the argument
+  string. Argument string is split at spaces. Single and double quotes group words into one argument and
+  backslash escapes a quote character. The result is kept and reused as long as the command and the
+  arguments stay the same.
+*/
+{
+    string cmd = command.get_path();
+    if(use_argv) {
+        if(!argv_dirty && cmd == argv_cmd)
+            return;
+        argv_cmd = cmd;
+        argv_ptr.clear();
+        argv_ptr.push_back(&argv_cmd[0]);
+        for(std::vector<string>::iterator ai=argv_list.begin(); ai!=argv_list.end(); ai++)
+            argv_ptr.push_back(const_cast<char*>(ai->c_str()));
+        argv_ptr.push_back(0);
+        argv_dirty = false;
+        return;
+    }
+
+    // Stream may contain old data beyond the put pointer after execa.
+    streamoff len = arguments.tellp();
+    string src = len>0 ? arguments.str().substr(0,(size_t)len) : string();
+    if(!argv_dirty && cmd == argv_cmd && src == argv_source)
+        return;
+    std::vector<size_t> offsets;
+    argv_buffer.assign(src.size()+1, 0);
+    if(!src.empty()) {
+        size_t pos = 0;
+        int ch, prev=' ', quote=0;
+        offsets.push_back(0);
+        for(string::iterator si=src.begin(); si!=src.end(); si++) {
+            ch = (unsigned char)*si;
+            if(quote) {
+                if(quote==ch) {
+                    if(prev!='\\')
+                        quote = 0;
+                    else
+                        argv_buffer[pos-1] = *si;
+                }
+                else
+                    argv_buffer[pos++] = *si;
+            }
+            else if(ch == '\'' || ch == '\"') {
+                if (prev=='\\')
+                    argv_buffer[pos-1] = *si;
+                else
+                    quote = ch;
+            }
+            else if(ch == ' ') {
+                if(prev!=' ') {
+                    argv_buffer[pos++] = 0;
+                    offsets.push_back(pos);
+                }
+            }
+            else
+                argv_buffer[pos++] = *si;
+            prev = ch;
+        }
+        if(quote)
+            throw process_exception("process::start - Unmatched quote marks in arguments.");
+        // Trailing spaces leave an empty argument at the end.
+        if(argv_buffer[offsets.back()] == 0)
+            offsets.pop_back();
+    }
+    argv_cmd = cmd;
+    argv_source = src;
+    argv_ptr.clear();
+    argv_ptr.push_back(&argv_cmd[0]);
+    for(std::vector<size_t>::iterator oi=offsets.begin(); oi!=offsets.end(); oi++)
+        argv_ptr.push_back(&argv_buffer[*oi]);
+    argv_ptr.push_back(0);
+    argv_dirty = false;
+}
+
+// ==================================================================================================
 void c4s::process::set_user(user *_owner)
 {
     if(_owner && _owner->status()==0)
@@ -849,6 +1632,522 @@ void c4s::process::set_user(user *_owner)
     }
 }
 // ------------------------------------------------------------------------------------------
+void c4s::process::redirect_to(const path &target, bool append)
+/*! Both child's stdout and stderr are written directly into the given file. Parent does not see the
+  output at all, i.e. pipe targets are not used for this process. Same as '>file 2>&1' in shell.
+  \param target File to write to. Created if it does not exist.
+  \param append If true output is appended to file. If false file is truncated at start.
+*/
+{
+    redir_out = target;
+    redir_append_out = append;
+    redir_err.clear();
+    redir_both = true;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::redirect_stdout(const path &target, bool append)
+/*! Child's stdout is written directly into the given file. Parent does not see the stdout anymore.
+  \param target File to write to. Created if it does not exist.
+  \param append If true output is appended to file. If false file is truncated at start.
+*/
+{
+    redir_out = target;
+    redir_append_out = append;
+    redir_both = false;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::redirect_stderr(const path &target, bool append)
+/*! Child's stderr is written directly into the given file. Parent does not see the stderr anymore.
+  \param target File to write to. Created if it does not exist.
+  \param append If true output is appended to file. If false file is truncated at start.
+*/
+{
+    if(redir_both) {
+        redir_out.clear();
+        redir_both = false;
+    }
+    redir_err = target;
+    redir_append_err = append;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::redirect_clear()
+{
+    redir_out.clear();
+    redir_err.clear();
+    redir_both = false;
+}
+// ------------------------------------------------------------------------------------------
+int c4s::process::open_redirect(const path &target, bool append)
+{
+    int flags = O_WRONLY|O_CREAT|O_CLOEXEC|(append ? O_APPEND : O_TRUNC);
+    int fd = open(target.get_path().c_str(), flags, 0666);
+    if(fd == -1) {
+        ostringstream os;
+        os << "process::open_redirect - Unable to open "<<target.get_path()<<" for the child output: "<<strerror(errno);
+        throw process_exception(os.str());
+    }
+    return fd;
+}
+// ------------------------------------------------------------------------------------------
+// Child reaper. Every started child has an entry in the reaper table until its owner has collected the
+// exit status. Sweeps move the status of exited children into the table so that they do not remain
+// zombies, and owners find it there with a single lookup. All wait4 calls for the children are made
+// here. On Linux the process reactor thread sweeps whenever a child exits.
+struct reaper_entry {
+    pid_t pid;
+    int fd;               //!< Reaper's own pidfd in reaper_epoll or -1.
+    bool exited;          //!< Child has been reaped by a sweep. Status and usage are valid.
+    bool orphan;          //!< Owner is gone. Entry is removed when the child has been reaped.
+    bool polled;          //!< Child has no pidfd and is checked with wait4 on every sweep.
+    int status;
+    int error;            //!< Errno of a failed wait4 or zero. Owner reports it.
+    struct rusage ru;
+};
+static std::mutex reaper_lock;
+static std::unordered_map<unsigned long long, reaper_entry> reaper_table;
+static unsigned long long reaper_serial = 0;
+static size_t reaper_polled = 0;   //!< Number of entries that are swept with wait4.
+#ifdef __linux
+static int reaper_epoll = -1;
+#endif
+
+static void reaper_unwatch(reaper_entry &re)
+/* Stops watching the child. Called with reaper_lock held. */
+{
+#ifdef __linux
+    if(re.fd>=0) {
+        epoll_ctl(reaper_epoll, EPOLL_CTL_DEL, re.fd, 0);
+        close(re.fd);
+        re.fd = -1;
+    }
+#endif
+    if(re.polled) {
+        re.polled = false;
+        reaper_polled--;
+    }
+}
+
+static void reaper_sweep(std::unordered_map<unsigned long long, reaper_entry>::iterator ri, bool block=false)
+/* Reaps the child if it has exited. Called with reaper_lock held. */
+{
+    reaper_entry &re = ri->second;
+    if(re.exited)
+        return;
+    pid_t cid;
+    do {
+        cid = wait4(re.pid, &re.status, block ? 0 : WNOHANG, &re.ru);
+    }while(cid == -1 && errno == EINTR);
+    if(cid == 0)
+        return;
+    if(cid == -1)
+        re.error = errno;
+    reaper_unwatch(re);
+    re.exited = true;
+    if(re.orphan)
+        reaper_table.erase(ri);
+}
+
+// ------------------------------------------------------------------------------------------
+void c4s::process::reap_all()
+/*! Exited children are found from the pidfds with a single epoll_wait on Linux. Children without a pidfd
+  and all children on OSX are checked with wait4. Status is kept until the owning process object asks for
+  it. On Linux the process reactor thread calls this whenever a child exits. On OSX long running scripts
+  that keep children running without waiting for them may call this periodically.
+*/
+{
+    std::lock_guard<std::mutex> guard(reaper_lock);
+#ifdef __linux
+    if(reaper_epoll>=0) {
+        struct epoll_event events[64];
+        int count;
+        do {
+            count = epoll_wait(reaper_epoll, events, 64, 0);
+            for(int ndx=0; ndx<count; ndx++) {
+                std::unordered_map<unsigned long long, reaper_entry>::iterator ri = reaper_table.find(events[ndx].data.u64);
+                if(ri != reaper_table.end())
+                    reaper_sweep(ri);
+            }
+        }while(count == 64);
+    }
+#endif
+    if(!reaper_polled)
+        return;
+    std::unordered_map<unsigned long long, reaper_entry>::iterator ri = reaper_table.begin();
+    while(ri != reaper_table.end()) {
+        std::unordered_map<unsigned long long, reaper_entry>::iterator next = ri;
+        next++;
+        if(ri->second.polled)
+            reaper_sweep(ri);
+        ri = next;
+    }
+}
+#ifdef __linux
+// ------------------------------------------------------------------------------------------
+int c4s::process::reaper_fd()
+/*! Process reactor watches this descriptor and calls reap_all when it becomes readable.
+  \retval int Epoll instance that holds the pidfds of the children or -1.
+*/
+{
+    std::lock_guard<std::mutex> guard(reaper_lock);
+    if(reaper_epoll<0)
+        reaper_epoll = epoll_create1(EPOLL_CLOEXEC);
+    return reaper_epoll;
+}
+// ------------------------------------------------------------------------------------------
+bool c4s::process::reaper_polling()
+/*! \retval bool True if some children have no pidfd and must be swept periodically.
+ */
+{
+    std::lock_guard<std::mutex> guard(reaper_lock);
+    return reaper_polled>0;
+}
+#endif
+// ------------------------------------------------------------------------------------------
+void c4s::process::track_child()
+/*! Adds the started child into the reaper table. On Linux the reaper watches a duplicate of the pidfd
+  and the process reactor is started to sweep the table when children exit.
+ */
+{
+#ifdef __linux
+    try {
+        process_reactor::instance();
+    }catch(const process_exception &) {
+        // Without the reactor children are reaped by the next start or wait.
+    }
+#endif
+    std::lock_guard<std::mutex> guard(reaper_lock);
+    reaper_entry re;
+    re.pid = pid;
+    re.fd = -1;
+    re.exited = false;
+    re.orphan = false;
+    re.polled = false;
+    re.status = 0;
+    re.error = 0;
+    reaper_ticket = ++reaper_serial;
+#ifdef __linux
+    if(pidfd>=0) {
+        if(reaper_epoll<0)
+            reaper_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if(reaper_epoll>=0)
+            re.fd = fcntl(pidfd, F_DUPFD_CLOEXEC, 0);
+        if(re.fd>=0) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = reaper_ticket;
+            if(epoll_ctl(reaper_epoll, EPOLL_CTL_ADD, re.fd, &ev) == -1) {
+                close(re.fd);
+                re.fd = -1;
+            }
+        }
+    }
+#endif
+    if(re.fd<0) {
+        re.polled = true;
+        reaper_polled++;
+    }
+    reaper_table[reaper_ticket] = re;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::release_child()
+/*! Called when the owner is destroyed with the child still in the table i.e. a started daemon. Exited
+  child is forgotten, running child is reaped by a later sweep.
+*/
+{
+    if(!reaper_ticket)
+        return;
+    std::lock_guard<std::mutex> guard(reaper_lock);
+    std::unordered_map<unsigned long long, reaper_entry>::iterator ri = reaper_table.find(reaper_ticket);
+    reaper_ticket = 0;
+    if(ri == reaper_table.end())
+        return;
+    if(ri->second.exited)
+        reaper_table.erase(ri);
+    else
+        ri->second.orphan = true;
+}
+// ------------------------------------------------------------------------------------------
+bool c4s::process::reap(bool block)
+/*! Collects the exit status of the child from the reaper table. If no sweep has reaped the child yet,
+  this child alone is swept.
+  \param block If true, waits until the child exits. Use only after SIGKILL.
+  \retval bool True if the child has exited and last_ret_val has been updated.
+*/
+{
+    std::lock_guard<std::mutex> guard(reaper_lock);
+    std::unordered_map<unsigned long long, reaper_entry>::iterator ri = reaper_table.find(reaper_ticket);
+    if(ri == reaper_table.end()) {
+        ostringstream os;
+        os<<"process::reap - name="<<command.get_base()<<", child "<<pid<<" is not in the reaper table.";
+        throw process_exception(os.str());
+    }
+    reaper_sweep(ri, block);
+    reaper_entry re = ri->second;
+    if(!re.exited)
+        return false;
+    reaper_table.erase(ri);
+    reaper_ticket = 0;
+    if(re.error) {
+        ostringstream os;
+        os<<"process::reap - name="<<command.get_base()<<", wait error: "<<strerror(re.error);
+        throw process_exception(os.str());
+    }
+    last_ret_val = re.status;
+    record_usage(re.ru);
+    return true;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::record_usage(const struct rusage &ru)
+/*! Stores the child's resource usage and adds it into the total usage.
+ */
+{
+    struct timespec ts_now;
+    clock_gettime(CLOCK_REALTIME,&ts_now);
+    usage.end_time = ts_now.tv_sec*1000LL + ts_now.tv_nsec/1000000;
+    usage.user_time = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6;
+    usage.sys_time = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+    usage.max_rss = ru.ru_maxrss;
+    usage.minor_faults = ru.ru_minflt;
+    usage.major_faults = ru.ru_majflt;
+    usage.vol_switches = ru.ru_nvcsw;
+    usage.invol_switches = ru.ru_nivcsw;
+    usage.count = 1;
+    std::lock_guard<std::mutex> guard(usage_lock);
+    total_usage.add(usage);
+}
+// ------------------------------------------------------------------------------------------
+c4s::proc_usage c4s::process::get_total_usage()
+{
+    std::lock_guard<std::mutex> guard(usage_lock);
+    return total_usage;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::reset_total_usage()
+{
+    std::lock_guard<std::mutex> guard(usage_lock);
+    total_usage.clear();
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::check_halt()
+/*! Sends termination signal to the child if an output function has asked to stop it. Exit is then
+  collected normally.
+*/
+{
+    if(!halt_sent && pid && pipes && pipes->halt_requested()) {
+        kill(pid, SIGTERM);
+        halt_sent = true;
+    }
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::signal_child(int sig, bool reaped)
+/*! Signals the child and, depending on the group setting, the rest of its process group or session.
+  Child itself is signaled through the pidfd when available, so a reused pid cannot be hit.
+  \param sig Signal to send.
+  \param reaped True if the child has already been reaped. Then only the group is signaled.
+*/
+{
+    if(group != PROC_GROUP::INHERIT) {
+        killpg(pid, sig);
+#ifdef __linux
+        if(group == PROC_GROUP::SESSION)
+            signal_session(pid, sig);
+#endif
+    }
+    if(reaped)
+        return;
+#if defined(__linux) && defined(SYS_pidfd_send_signal)
+    if(pidfd>=0 && syscall(SYS_pidfd_send_signal, pidfd, sig, 0, 0) == 0)
+        return;
+#endif
+    if(kill(pid, sig) == -1 && errno != ESRCH) {
+        ostringstream os;
+        os << "process::stop - Unable to send signal "<<sig<<" to process "<<pid<<": "<<strerror(errno);
+        throw process_exception(os.str());
+    }
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::signal_session(pid_t sid, int sig)
+/*! Sends the signal to the processes of the session that have moved out of the leader's process group.
+  Processes are found from /proc. (Linux)
+*/
+{
+#ifdef __linux
+    char name[64], stat[512];
+    DIR *dir = opendir("/proc");
+    if(!dir)
+        return;
+    struct dirent *de;
+    while((de = readdir(dir)) != 0) {
+        pid_t sp = (pid_t)atoi(de->d_name);
+        if(sp<=0)
+            continue;
+        snprintf(name, sizeof(name), "/proc/%d/stat", (int)sp);
+        int fd = open(name, O_RDONLY|O_CLOEXEC);
+        if(fd<0)
+            continue;
+        ssize_t len = read(fd, stat, sizeof(stat)-1);
+        close(fd);
+        if(len<=0)
+            continue;
+        stat[len] = 0;
+        // Command name may contain spaces and parenthesis. Fields continue after the last ')'.
+        char *rp = strrchr(stat, ')');
+        char state;
+        int ppid, pgrp, session;
+        if(rp && sscanf(rp+1, " %c %d %d %d", &state, &ppid, &pgrp, &session) == 4
+           && session == sid && pgrp != sid)
+            kill(sp, sig);
+    }
+    closedir(dir);
+#endif
+}
+// ------------------------------------------------------------------------------------------
+bool c4s::process::wait_gone(long long ms)
+/*! Waits for a process that is not necessarily a child of this process to exit.
+  \param ms Maximum number of milliseconds to wait.
+  \retval bool True if the process has exited.
+*/
+{
+    long long deadline = now_ms() + ms;
+    for(;;) {
+        long long left = deadline - now_ms();
+        if(left<0)
+            left = 0;
+        if(pidfd>=0) {
+            struct pollfd pfd;
+            pfd.fd = pidfd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if(poll(&pfd, 1, (int)left) > 0)
+                return true;
+        }
+        else {
+            if(kill(pid, 0) == -1 && errno == ESRCH)
+                return true;
+            if(left>0) {
+                struct timespec ts;
+                ts.tv_sec = 0;
+                ts.tv_nsec = (left<PROC_POLL_TICK ? left : PROC_POLL_TICK)*1000000L;
+                nanosleep(&ts, 0);
+            }
+        }
+        if(left == 0)
+            return false;
+    }
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::terminate(const std::vector<process*> &procs)
+/*! Sends SIGTERM to all children first and then waits on their pidfds until each child has exited or its
+  grace period has expired. Remaining children are killed with SIGKILL. With a process group or session
+  the wait continues until the other members are gone too. Children are reaped and their pid is cleared.
+  Pipes and pidfds are left for stop.
+*/
+{
+    struct pending {
+        process *proc;
+        long long deadline;
+        bool reaped;
+    };
+    std::vector<pending> waiting;
+    std::vector<struct pollfd> pfd;
+    long long now = now_ms();
+    for(std::vector<process*>::const_iterator pi=procs.begin(); pi!=procs.end(); pi++) {
+        process *pr = *pi;
+        if(!pr->pid)
+            continue;
+        pending pe;
+        pe.proc = pr;
+        pe.deadline = now + pr->grace.count();
+        pe.reaped = pr->reap();
+        if(!pe.reaped || pr->group != PROC_GROUP::INHERIT)
+            pr->signal_child(SIGTERM, pe.reaped);
+        waiting.push_back(pe);
+    }
+    while(!waiting.empty()) {
+        size_t pos = 0;
+        now = now_ms();
+        for(size_t ndx=0; ndx<waiting.size(); ndx++) {
+            pending &pe = waiting[ndx];
+            process *pr = pe.proc;
+            if(!pe.reaped)
+                pe.reaped = pr->reap();
+            bool alive = !pe.reaped || (pr->group != PROC_GROUP::INHERIT && killpg(pr->pid, 0) == 0);
+            if(alive && now >= pe.deadline) {
+                pr->signal_child(SIGKILL, pe.reaped);
+#ifdef C4S_DEBUGTRACE
+                cerr <<"process::stop - used KILL to stop "<<pr->pid<<".\n";
+#endif
+                if(!pe.reaped)
+                    pr->reap(true);
+                alive = false;
+            }
+            if(alive)
+                waiting[pos++] = pe;
+            else
+                pr->pid = 0;
+        }
+        waiting.resize(pos);
+        if(waiting.empty())
+            break;
+
+        // Wait for the next exit or the nearest deadline.
+        long long delay = -1;
+        bool tick = false;
+        pfd.resize(waiting.size());
+        for(size_t ndx=0; ndx<waiting.size(); ndx++) {
+            pfd[ndx].fd = waiting[ndx].reaped ? -1 : waiting[ndx].proc->pidfd;
+            pfd[ndx].events = POLLIN;
+            pfd[ndx].revents = 0;
+            if(pfd[ndx].fd<0)
+                tick = true;
+            long long left = waiting[ndx].deadline - now;
+            if(delay<0 || left<delay)
+                delay = left>0 ? left : 0;
+        }
+        if(tick && delay>PROC_POLL_TICK)
+            delay = PROC_POLL_TICK;
+        if(poll(&pfd[0], pfd.size(), (int)delay) == -1 && errno != EINTR) {
+            ostringstream os;
+            os << "process::stop - poll error: "<<strerror(errno);
+            throw process_exception(os.str());
+        }
+    }
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::stop_all(const std::vector<process*> &procs)
+/*! All children are sent SIGTERM at the same time and then waited for together, so stopping many
+  processes takes at most the longest grace period. Daemons are stopped one by one. Resources are
+  released as with stop.
+  \param procs Processes to stop. Processes that are not running are just cleaned up.
+*/
+{
+    std::vector<process*> children;
+    for(std::vector<process*>::const_iterator pi=procs.begin(); pi!=procs.end(); pi++) {
+        if((*pi)->pid && !(*pi)->daemon)
+            children.push_back(*pi);
+    }
+    terminate(children);
+    for(std::vector<process*>::const_iterator pi=procs.begin(); pi!=procs.end(); pi++)
+        (*pi)->stop();
+}
+// ------------------------------------------------------------------------------------------
+long long c4s::process::now_ms()
+/*! \retval long long Milliseconds from the monotonic clock. Use for deadlines.
+*/
+{
+    struct timespec ts_now;
+    clock_gettime(CLOCK_MONOTONIC,&ts_now);
+    return ts_now.tv_sec*1000LL + ts_now.tv_nsec/1000000;
+}
+// ------------------------------------------------------------------------------------------
+void c4s::process::close_pidfd()
+{
+    if(pidfd>=0) {
+        close(pidfd);
+        pidfd = -1;
+    }
+}
+// ------------------------------------------------------------------------------------------
 void c4s::process::attach(int _pid)
 /*! Attaching allows developer to stop running processes by first attaching object to a process
   and then calling stop-function. Exception is thrown if pid is not found. If process alredy is running
@@ -861,6 +2160,10 @@ void c4s::process::attach(int _pid)
     pid = _pid;
     last_ret_val = 0;
     daemon = true;
+#if defined(__linux) && defined(SYS_pidfd_open)
+    // Pidfd refers to this process even if the pid is later reused.
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
     if(!is_running()) {
         ostringstream os;
         os << "process::attach - Cannot attach. Process with PID ("<<pid<<") not found.";
@@ -893,9 +2196,11 @@ void c4s::process::attach(const path &pid_file)
 #endif // linux || Apple
 
 // ==================================================================================================
-int c4s::process::wait_for_exit(int timeout)
-/*! If the timeout expires the process_exception is trown.
-  \param timeout Number of seconds to wait.
+int c4s::process::wait_for_exit(std::chrono::milliseconds timeout)
+/*! If the timeout expires the process_exception is trown. Deadline is kept with millisecond precision
+  from the monotonic clock. If the cancel token is cancelled the process is stopped and
+  process_exception is thrown.
+  \param timeout Time to wait, e.g. std::chrono::milliseconds(300) or std::chrono::seconds(5).
   \retval int Return value from the process.
 */
 {
@@ -907,40 +2212,66 @@ int c4s::process::wait_for_exit(int timeout)
     }
     ostream *pipe = pipe_global ? pipe_global : pipe_target;
 #ifdef C4S_DEBUGTRACE
-    cerr << "process::wait_for_exit - name="<<command.get_base()<<", pid="<<pid<<", timeout="<<timeout;
+    cerr << "process::wait_for_exit - name="<<command.get_base()<<", pid="<<pid<<", timeout="<<timeout.count()<<"ms";
     if(!pipe) cerr << ", quiet mode\n";
     else cerr << '\n';
     time_t beg = time(0);
 #endif
 #if defined(__linux) || defined(__APPLE__)
-    int counter = timeout*10;
-    struct timespec ts_delay, ts_remain;
-    ts_delay.tv_sec = 0;
-    ts_delay.tv_nsec = 100000000L;
-    pid_t wait_val;
-    do {
-        nanosleep(&ts_delay,&ts_remain);
-        pipes->read_child_stderr(pipe);
-        pipes->read_child_stdout(pipe);
-        wait_val = waitpid(pid, &last_ret_val, WNOHANG);
-        if(wait_val && wait_val!= pid) {
+    struct pollfd pfd[5];
+    bool exited;
+    long long now = now_ms();
+    long long deadline = now + timeout.count();
+    for(;;) {
+        exited = reap();
+        if(exited || now >= deadline)
+            break;
+        if(cancel && cancel->is_cancelled()) {
+            stop();
+            ostringstream os;
+            os << "process::wait_for_exit - name="<<command.get_base()<<"; Process cancelled!";
+            throw process_exception(os.str());
+        }
+        pfd[0].fd = pipes->get_fd_out();
+        pfd[1].fd = pipes->get_fd_err();
+        pfd[2].fd = pidfd;
+        pfd[3].fd = pipes->get_fd_in();
+        pfd[4].fd = cancel ? cancel->get_fd() : -1;
+        for(int i=0; i<5; i++) {
+            pfd[i].events = i!=3 ? POLLIN : POLLOUT;
+            pfd[i].revents = 0;
+        }
+        long long delay = deadline - now;
+        if(pidfd<0 && delay>PROC_POLL_TICK)
+            delay = PROC_POLL_TICK;
+        if(poll(pfd, 5, (int)delay) == -1 && errno != EINTR) {
             ostringstream os;
-            os<<"process::wait_for_exit - name="<<command.get_base()<<", wait error: "<<strerror(errno);
+            os<<"process::wait_for_exit - name="<<command.get_base()<<", poll error: "<<strerror(errno);
             throw process_exception(os.str());
         }
-        counter--;
-    }while(!wait_val && counter>0);
+        if(pfd[0].revents)
+            pipes->read_child_stdout(pipe);
+        if(pfd[1].revents)
+            pipes->read_child_stderr(pipe);
+        if(pfd[3].revents & (POLLERR|POLLHUP))
+            pipes->close_child_input();
+        else if(pfd[3].revents)
+            pipes->feed_child_input();
+        check_halt();
+        now = now_ms();
+    }
     pipes->read_child_stderr(pipe);
     pipes->read_child_stdout(pipe);
 #ifdef C4S_DEBUGTRACE
-    cerr <<"process::wait_for_exit - name="<<command.get_base()<<", retval:"<<last_ret_val<<", counter:"<<counter<<", seconds:"<<time(0)-beg;
+    cerr <<"process::wait_for_exit - name="<<command.get_base()<<", retval:"<<last_ret_val<<", seconds:"<<time(0)-beg;
     cerr <<", br_out:"<<pipes->get_br_out()<<", br_err:"<<pipes->get_br_err()<<'\n';
 #endif
-    if(counter<=0) {
+    if(!exited) {
         ostringstream os;
         os << "process::wait_for_exit - name="<<command.get_base()<<", pid="<<pid<<"; Process timeout!";
         throw process_exception(os.str());
     }
+    close_pidfd();
 
 #else // Win32 ------------------------------
     DWORD lapse, now, start = GetTickCount();
@@ -958,7 +2289,7 @@ int c4s::process::wait_for_exit(int timeout)
             if(ndx==2 && pipes)
                 pipes->read_child_stderr(pipe);
         }
-    }while( wfmo <= WAIT_TIMEOUT && lapse<(DWORD)timeout*1000);
+    }while( wfmo <= WAIT_TIMEOUT && lapse<(DWORD)timeout.count());
 
     if(wfmo>WAIT_TIMEOUT) {
         ostringstream os;
@@ -966,7 +2297,7 @@ int c4s::process::wait_for_exit(int timeout)
         throw process_exception(os.str());
     }
     // Check for the timeout
-    if(lapse>=(DWORD)timeout*1000) {
+    if(lapse>=(DWORD)timeout.count()) {
         ostringstream os;
         cerr <<"process::wait_for_exit - name="<<command.get_base()<<", pid="<<(int)pid<<"; Process timeout!";
         throw process_exception(os.str());
@@ -982,9 +2313,15 @@ int c4s::process::wait_for_exit(int timeout)
     pipes->read_child_stdout(pipe);
     pipes->read_child_stderr(pipe);
     stop();
-    if(nzrv_exception && last_ret_val!=0) {
+    if(nzrv_exception && last_ret_val!=0
+#if defined(__linux) || defined(__APPLE__)
+       && !halt_sent
+#endif
+        ) {
         ostringstream os;
-        os << "Process: '"<<command.get_base()<<' '<<arguments.str()<<"' retured:"<<last_ret_val;
+        os << "Process: '"<<command.get_base()<<' ';
+        print_args(os);
+        os << "' retured:"<<last_ret_val;
         throw process_exception(os.str());
     }
     return last_ret_val;
@@ -999,10 +2336,26 @@ int c4s::process::execa(const char *plus, int timeout)
   \retval int Return value from the command.
 */
 {
+    int rv;
+    if(use_argv) {
+        argv_list.push_back(plus);
+        argv_dirty = true;
+        try {
+            start();
+            rv = wait_for_exit(timeout);
+        }catch(const process_exception &) {
+            argv_list.pop_back();
+            argv_dirty = true;
+            throw;
+        }
+        argv_list.pop_back();
+        argv_dirty = true;
+        return rv;
+    }
     streampos end = arguments.tellp();
     arguments<<' '<<plus;
     start();
-    int rv = wait_for_exit(timeout);
+    rv = wait_for_exit(timeout);
     arguments.seekp(end);
     return rv;
 }
@@ -1044,7 +2397,11 @@ bool c4s::process::is_running()
     if(!pid)
         return false;
 #if defined(__linux) || defined(__APPLE__)
-    if(kill(pid, 0) == 0)
+    if(!daemon) {
+        if(!reap())
+            return true;
+    }
+    else if(!wait_gone(0))
         return true;
 #else
     DWORD rv;
@@ -1058,58 +2415,44 @@ bool c4s::process::is_running()
     return false;
 }
 
+// ==================================================================================================
+int c4s::process::last_return_value()
+/*! If the child has exited but has not been waited for, the status is read from the reaper table. On
+  Linux the table is kept up to date by the process reactor thread.
+  \retval int Return value of the last execution.
+*/
+{
+#if defined(__linux) || defined(__APPLE__)
+    if(pid && reaper_ticket) {
+        std::lock_guard<std::mutex> guard(reaper_lock);
+        std::unordered_map<unsigned long long, reaper_entry>::iterator ri = reaper_table.find(reaper_ticket);
+        if(ri != reaper_table.end() && ri->second.exited && !ri->second.error)
+            return ri->second.status;
+    }
+#endif
+    return last_ret_val;
+}
+
 // ==================================================================================================
 void c4s::process::stop_daemon()
+/*! Daemon is not a child of this process, so its exit cannot be collected. Exit is detected from the
+  pidfd or, without one, with kill(pid,0). Daemon is killed if it has not exited when the grace period
+  expires.
+*/
 {
 #if defined(__linux) || defined(__APPLE__)
-    ostringstream os;
 #ifdef C4S_DEBUGTRACE
     cerr << "process::stop_daemon - name="<<command.get_base()<<'\n';
 #endif
     if(!pid)
         return;
-    // Send termination signal.
-    if(kill(pid,SIGTERM)) {
-#ifdef C4S_DEBUGTRACE
-      cerr << "process::stop: kill(pid,SIGTERM) error:"<<strerror(errno) <<'\n';
-#else
-      os << "process::stop: kill(pid,SIGTERM) error:"<<strerror(errno) <<'\n';
-#endif
-        throw process_exception(os.str());
-    }
-    // Lets wait for a while:
-    struct timespec ts_delay, ts_remain;
-    ts_delay.tv_sec = 0;
-    ts_delay.tv_nsec = 400000000L;
-    int rv, count=20;
-    do {
-        nanosleep(&ts_delay,&ts_remain);
-        rv = kill(pid,0);
-        count--;
-    }while(count>0 && rv==0);
-#ifdef C4S_DEBUGTRACE
-    cerr <<"process::stop_daemon - term result:"<<rv<<"; count="<<count<<"; errno="<<errno<<'\n';
-#endif
-    if(count==0) {
-        count = 10;
-        kill(pid,SIGKILL);
-        do {
-            nanosleep(&ts_delay,&ts_remain);
-            rv = kill(pid,0);
-            count--;
-        }while(count>0 && rv==0);
-#ifdef C4S_DEBUGTRACE
-        cerr <<"process::stop_daemon - kill result:"<<rv<<"; count="<<count<<"; errno="<<errno<<'\n';
-#endif
-        if(count==0)
+    signal_child(SIGTERM, false);
+    if(!wait_gone(grace.count())) {
+        signal_child(SIGKILL, false);
+        if(!wait_gone(grace.count()))
             throw process_exception("process::stop_daemon - Failed, daemon sill running.");
     }
-    if(errno!=ESRCH) {
-#ifdef C4S_DEBUGTRACE
-      cerr << "process::stop_daemon - error stopping daemon\n";
-#endif
-        throw process_exception("process::stop_daemon - error stopping daemon");
-    }
+    close_pidfd();
     pid = 0;
 #endif
 }
@@ -1132,40 +2475,8 @@ void c4s::process::stop()
 	return;
       }
 #if defined(__linux) || defined(__APPLE__)
-        ostringstream os;
-    AGAIN:
-        pid_t cid = waitpid(pid,&last_ret_val,WNOHANG|WUNTRACED);
-        if(cid == 0) {
-            if(kill(pid,SIGTERM)) {
-                os << "Unable to send termination signal to running process:"<<pid<<". (errno="<<errno<<")";
-                throw process_exception(os.str());
-            }
-            cid = waitpid(pid,&last_ret_val,WNOHANG|WUNTRACED);
-            if(cid == 0) {
-                if(kill(pid,SIGKILL)) {
-                    os << "Unable to kill process "<<pid<<". (errno="<<errno<<")";
-                    throw process_exception(os.str());
-                }
-            }
-#ifdef C4S_DEBUGTRACE
-            cerr <<"Process::stop - used TERM/KILL to stop "<<pid<<".\n";
-#endif
-        }
-        if(cid == -1) {
-#ifdef C4S_DEBUGTRACE
-            cerr << "process::stop - name="<<command.get_base()<<", waitpid failed. Errno="<<errno<<'\n';
-#endif
-            if(errno == EINTR)
-                goto AGAIN;
-            else if(errno == ECHILD) {
-                // Process was probably attached and hence this is not a parent for the process.
-	      os << "process::stop: waitpid error:"<<strerror(errno) <<'\n';
-	      throw process_exception(os.str());
-            }
-            else{
-                throw process_exception("Process::stop: Invalid argument to wait-function.");
-            }
-        }
+        std::vector<process*> single(1, this);
+        terminate(single);
 #else // __linux
         if(!TerminateProcess(pid,999)){
             if(pipes) {
@@ -1181,8 +2492,14 @@ void c4s::process::stop()
 #endif
         pid=0;
     } // if(pid)
-
+#if defined(__linux) || defined(__APPLE__)
+    close_pidfd();
+#endif
     if(pipes) {
+#if defined(__linux) || defined(__APPLE__)
+        stats_out = pipes->st_out;
+        stats_err = pipes->st_err;
+#endif
         delete pipes;
         pipes = 0;
     }
@@ -1197,6 +2514,20 @@ void c4s::process::catch_output(const char *cmd, const char *args, string &outpu
   \param output Buffer where the output will be stored into.
 */
 {
+#if defined(__linux) || defined(__APPLE__)
+    // Both streams into the same buffer like pipe_to would do.
+    capture_buffer cb;
+    process source(cmd,args);
+    source.capture_to(&cb, &cb);
+    int rv = source();
+    if(rv) {
+        ostringstream err;
+        err << "process::catch-output - command returned error "<<rv;
+        err << ". Output: "<<cb.str();
+        throw process_exception(err.str());
+    }
+    output = cb.str();
+#else
     ostringstream os;
     process source(cmd,args);
     source.pipe_to(&os);
@@ -1208,6 +2539,7 @@ void c4s::process::catch_output(const char *cmd, const char *args, string &outpu
         throw process_exception(err.str());
     }
     output = os.str();
+#endif
 }
 
 // ==================================================================================================
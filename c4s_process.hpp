@@ -21,6 +21,18 @@ Copyright (c) Menacon Ltd, Finland
 #ifndef C4S_PROCESS_HPP
 #define C4S_PROCESS_HPP
 
+#include <chrono>
+#if defined(__linux) || defined(__APPLE__)
+ #include <functional>
+ #include <atomic>
+#endif
+#ifdef __linux
+ #include <future>
+#endif
+#if defined(__linux) || defined(__APPLE__)
+struct rusage;
+#endif
+
 namespace c4s {
 
     class compiled_file;
@@ -28,6 +40,181 @@ namespace c4s {
     class variables;
 #if defined(__linux) || defined(__APPLE__)
     class user;
+    class capture_buffer;
+
+    //! Methods to launch the child process. (Linux & OSX)
+    enum class PROC_LAUNCH : unsigned char {
+        FORK,   ///< fork + execv. Parent's address space is duplicated for the child.
+        SPAWN,  ///< posix_spawn. Does not copy the parent's page tables. Fork is used if user has been set.
+        SERVER  ///< Through the fork_server (Linux). Spawn is used if the server is not running or user has been set.
+    };
+    //! Process group of the child. (Linux & OSX)
+    enum class PROC_GROUP : unsigned char {
+        INHERIT,  ///< Child stays in the parent's process group. Stop signals the child only.
+        GROUP,    ///< Child leads a new process group. Stop signals the whole group.
+        SESSION   ///< Child leads a new session. Stop signals every process in the session (Linux) or its group (OSX).
+    };
+    //! Poll interval (ms) for child exit when the kernel does not support pidfd.
+    const int PROC_POLL_TICK=10;
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Cancels the waits of any number of processes at once. (Linux & OSX)
+    /*! Token is given to processes, process groups and pipelines with set_cancel. Cancel may be called
+      from any thread. Waits that use the token wake up immediately, terminate their children with
+      process::stop and throw process_exception. Process group stops the running jobs and skips the ones not
+      yet started. Token stays cancelled until it is reset.
+    */
+    class cancel_token
+    {
+    public:
+        cancel_token();
+        ~cancel_token();
+        cancel_token(const cancel_token &) = delete;
+        cancel_token& operator=(const cancel_token &) = delete;
+
+        //! Cancels all waits that use this token.
+        void cancel();
+        //! Returns true if the token has been cancelled.
+        bool is_cancelled() { return cancelled.load(); }
+        //! Clears the cancellation. Must not be called while waits are using the token.
+        void reset();
+        //! Returns a descriptor that becomes readable when the token is cancelled. Use with poll.
+        int get_fd() { return fd[0]; }
+
+    protected:
+        std::atomic<bool> cancelled;
+        int fd[2];  //!< Eventfd on Linux (write end is -1), pipe on OSX.
+    };
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Resource usage of a child process as reported by the kernel when the child is reaped. (Linux & OSX)
+    struct proc_usage
+    {
+        proc_usage() { clear(); }
+        //! Sets all counters to zero.
+        void clear();
+        //! Adds the counters of the given usage into this one. Max RSS is the maximum of the two.
+        void add(const proc_usage &);
+        //! Returns the elapsed wall-clock time in seconds.
+        double wall() const { return (end_time-start_time)/1000.0; }
+        //! Writes the usage as one line into the given stream.
+        void dump(ostream &) const;
+
+        long long start_time;   //!< Start time in milliseconds since epoch.
+        long long end_time;     //!< Exit time in milliseconds since epoch. Sum of wall times in aggregate.
+        double user_time;       //!< User CPU time in seconds.
+        double sys_time;        //!< System CPU time in seconds.
+        long max_rss;           //!< Maximum resident set size. In kilobytes on Linux, bytes on OSX.
+        long minor_faults;      //!< Page faults serviced without I/O.
+        long major_faults;      //!< Page faults that required I/O.
+        long vol_switches;      //!< Voluntary context switches.
+        long invol_switches;    //!< Involuntary context switches.
+        unsigned long count;    //!< Number of processes included.
+    };
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Throughput counters of one child output stream. (Linux & OSX)
+    struct pipe_stats
+    {
+        pipe_stats() { clear(); }
+        //! Sets all counters to zero.
+        void clear();
+        //! Returns the throughput in bytes per second between the first and the last read.
+        double rate() const;
+        //! Writes the counters as one line into the given stream.
+        void dump(ostream &) const;
+
+        unsigned long long bytes; //!< Bytes read from the child.
+        unsigned long reads;    //!< Reads that returned data.
+        unsigned long full_reads; //!< Reads that filled the whole buffer i.e. the child was ahead of the parent.
+        size_t max_read;        //!< Largest single read.
+        size_t capacity;        //!< Pipe capacity in bytes or zero if not known.
+        long long first_read;   //!< Monotonic time (ms) of the first read.
+        long long last_read;    //!< Monotonic time (ms) of the last read.
+    };
+    //! Largest pipe capacity the library asks for with process::set_pipe_size.
+    const size_t PROC_MAX_PIPE_SIZE=0x100000;
+
+    //! I/O scheduling classes for proc_controls::set_ioprio. (Linux)
+    enum class IO_CLASS : unsigned char {
+        NONE=0,         ///< Derived from the CPU nice value.
+        REALTIME=1,     ///< Served first. Needs CAP_SYS_ADMIN.
+        BEST_EFFORT=2,  ///< Default class. Levels 0 (highest) to 7.
+        IDLE=3          ///< Served only when no other process needs the disk.
+    };
+    //! Maximum number of CPUs in the proc_controls affinity mask.
+    const int PROC_MAX_CPUS=1024;
+    //! Maximum number of resource limits in proc_controls.
+    const int PROC_MAX_LIMITS=16;
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Scheduling and resource controls applied to the child between fork and exec. (Linux & OSX)
+    /*! Controls are applied before the user switch so that a privileged parent can give a child more than
+      it is allowed to have. Structure is plain data so that it can be passed to the fork server as is.
+      See process::set_controls and process_group::set_controls.
+    */
+    struct proc_controls
+    {
+        proc_controls() { clear(); }
+        //! Removes all controls.
+        void clear();
+        //! Returns true if no controls have been set.
+        bool empty() const { return !use_nice && !ioprio && !use_affinity && !limit_count; }
+        //! Sets the nice value, -20 (highest priority) to 19 (lowest).
+        void set_nice(int n) { nice = n; use_nice = true; }
+        //! Sets the I/O scheduling class and level 0-7 (ioprio_set). (Linux)
+        void set_ioprio(IO_CLASS cls, int level=4) { ioprio = cls==IO_CLASS::NONE ? 0 : ((int)cls<<13)|(level&7); }
+        //! Adds the CPU into the affinity mask. Child runs only on the added CPUs. (Linux)
+        void add_cpu(int cpu);
+        //! Sets a limit (setrlimit), e.g. RLIMIT_AS, RLIMIT_CPU or RLIMIT_NOFILE. Use RLIM_INFINITY for no limit.
+        void set_rlimit(int resource, unsigned long long soft, unsigned long long hard);
+        //! Sets both soft and hard limit for the resource.
+        void set_rlimit(int resource, unsigned long long limit) { set_rlimit(resource, limit, limit); }
+        //! Applies the controls to the calling process. Async-signal-safe. \retval int Zero or errno.
+        int apply() const;
+
+        int nice;               //!< Nice value if use_nice is set.
+        bool use_nice;
+        int ioprio;             //!< Encoded I/O priority or zero if not set.
+        bool use_affinity;      //!< If true, cpu_mask is applied.
+        unsigned long long cpu_mask[PROC_MAX_CPUS/64];
+        int limit_count;        //!< Number of items in limits.
+        struct {
+            int resource;
+            unsigned long long soft, hard;
+        } limits[PROC_MAX_LIMITS];
+    };
+#endif
+#if defined(__linux) || defined(__APPLE__)
+    //! Function that receives child output. Data is valid only during the call. Return false to stop the child.
+    typedef std::function<bool(const char *data, size_t len)> output_fn;
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Passes child output to a function either line by line or in chunks as read. (Linux & OSX)
+    struct output_handler
+    {
+        output_handler() { lines = true; halted = false; }
+        //! Passes the data to the function. \retval bool False if the function has asked to stop.
+        bool feed(const char *data, size_t len);
+        //! Passes the last line without a newline to the function. Called at end of output.
+        void flush();
+        //! Clears the state for a new run.
+        void reset() { partial.clear(); halted = false; }
+
+        output_fn fn;       //!< Receiving function.
+        bool lines;         //!< If true the function gets complete lines without the newline.
+        bool halted;        //!< True after the function has returned false.
+        string partial;     //!< Start of a line that continues in the next read.
+    };
+#endif
+#ifdef __linux
+    //! Result of an asynchronously run process. (Linux)
+    struct proc_result
+    {
+        int rv;         //!< Return value as given by process::last_return_value.
+        string out;     //!< Captured stdout.
+        string err;     //!< Captured stderr.
+    };
 #endif
     // ----------------------------------------------------------------------------------------------------
     //! Process pipes wraps three pipes needed to communicate with child programs / binaries
@@ -40,6 +227,7 @@ namespace c4s {
         void reset();
 #if defined(__linux) || defined(__APPLE__)
         void init_child();
+        void init_child(posix_spawn_file_actions_t *);
         void init_parent();
 #else
         void init(STARTUPINFO *, HANDLE *);
@@ -49,16 +237,54 @@ namespace c4s {
         size_t write_child_input(const path &);
         void write_child_input(const string&);
         void close_child_input();
+#if defined(__linux) || defined(__APPLE__)
+        void open_child_input(const path &);
+        size_t feed_child_input();
+#endif
         size_t get_br_out() { return br_out; }
         size_t get_br_err() { return br_err; }
+#if defined(__linux) || defined(__APPLE__)
+        //! Grows the stdout and stderr pipes to the given size. (Linux)
+        void set_capacity(size_t);
+        //! Returns the stdout counters.
+        const pipe_stats& get_stats_out() { return st_out; }
+        //! Returns the stderr counters.
+        const pipe_stats& get_stats_err() { return st_err; }
+#endif
+#if defined(__linux) || defined(__APPLE__)
+        //! Returns true if an output handler has asked to stop the child.
+        bool halt_requested() { return (hnd_out && hnd_out->halted) || (hnd_err && hnd_err->halted); }
+#endif
+#if defined(__linux) || defined(__APPLE__)
+        //! Returns the read end of child's stdout or -1 if it has been closed. Use for polling.
+        int get_fd_out() { return fd_out[0] ? fd_out[0] : -1; }
+        //! Returns the read end of child's stderr or -1 if it has been closed. Use for polling.
+        int get_fd_err() { return fd_err[0] ? fd_err[0] : -1; }
+        //! Returns the write end of child's stdin if input file is being fed, -1 otherwise. Use for polling.
+        int get_fd_in() { return fd_src && fd_in[1] ? fd_in[1] : -1; }
+#endif
     protected:
         size_t br_out, br_err;
         bool send_ctrlZ;
 #if defined(__linux) || defined(__APPLE__)
+        size_t drain(int &fd, ostream *, output_handler *oh, pipe_stats &);
+        static bool create_pipe(int *fds);
+        void redirect(int *fd_pipe, int fd);
+        void redirect_input(int fd);
         int fd_out[2];
         int fd_err[2];
         int fd_in[2];
+        int fd_src;         //!< Input file that is being fed to child's stdin.
+        off_t src_offset;   //!< Read offset in the input file.
+        bool use_splice;    //!< False if input file does not support splice.
+        capture_buffer *cap_out; //!< If set, child's stdout is read into this instead of the stream.
+        capture_buffer *cap_err; //!< If set, child's stderr is read into this instead of the stream.
+        output_handler *hnd_out; //!< If set, child's stdout is passed to this instead of the stream.
+        output_handler *hnd_err; //!< If set, child's stderr is passed to this instead of the stream.
         size_t br_in;
+        pipe_stats st_out;  //!< Counters for child's stdout.
+        pipe_stats st_err;  //!< Counters for child's stderr.
+        std::vector<char> big_buffer; //!< Second read buffer for pipes larger than the stack buffer.
 #else
         struct winpipe {
             winpipe(bool);
@@ -76,6 +302,8 @@ namespace c4s {
         winpipe out, err, in;
         DWORD br_in;
 #endif
+        friend class process;
+        friend class pipeline;
     };
 
     // ----------------------------------------------------------------------------------------------------
@@ -114,21 +342,31 @@ namespace c4s {
 
         //! Runs the process with given timeout value and optional arguments.
         int operator() (int timeout, const char *args=0) { return exec(timeout,args); }
+        //! Runs the process with given timeout e.g. std::chrono::milliseconds(500).
+        int operator() (std::chrono::milliseconds timeout) { return exec(timeout); }
         //! Runs the process with default timeout
         int operator() () { return exec(C4S_PROC_TIMEOUT); }
         //! Runs the process and captures the output to given stream.
         int operator() (ostream *out, int to=C4S_PROC_TIMEOUT) { pipe_to(out); return exec(to); }
 
         //! Sets the given string as single argument string for this process.
-        void set_args(const char *arg) { arguments.str(""); arguments<<arg; }
+        void set_args(const char *arg) { arguments.str(""); arguments<<arg; use_argv=false; argv_dirty=true; }
         //! Sets the given string as single argument string for this process.
-        void set_args(const string &arg) { arguments.str(""); arguments<<arg; }
-        //! Adds given string into argument list as quoted string
-        void add_quoted_args(const string &arg) { arguments<<" '"<<arg<<'\''; }
-        //! Adds the given string into argument list.
-        void operator+=(const char* arg) { arguments <<' '<<arg; }
-        //! Adds the given string into argument list.
-        void operator+=(const string &arg) { arguments<<' '<<arg; }
+        void set_args(const string &arg) { arguments.str(""); arguments<<arg; use_argv=false; argv_dirty=true; }
+        //! Sets the arguments as a vector. Each item is passed to the child as is, i.e. quotes and spaces are not parsed.
+        void set_argv(const std::vector<string> &av) { argv_list = av; use_argv = true; argv_dirty = true; }
+        //! Appends one argument to argument vector. Argument string set with set_args or += is discarded.
+        void add_arg(const string &arg) {
+            if(!use_argv) { argv_list.clear(); use_argv = true; }
+            argv_list.push_back(arg);
+            argv_dirty = true;
+        }
+        //! Adds given string into argument list as quoted string. In vector mode it is appended as one argument.
+        void add_quoted_args(const string &arg) { if(use_argv) add_arg(arg); else arguments<<" '"<<arg<<'\''; }
+        //! Adds the given string into argument list. In vector mode it is appended as one argument.
+        void operator+=(const char* arg) { if(use_argv) add_arg(arg); else arguments <<' '<<arg; }
+        //! Adds the given string into argument list. In vector mode it is appended as one argument.
+        void operator+=(const string &arg) { if(use_argv) add_arg(arg); else arguments<<' '<<arg; }
 
         //! Given file is fed to child's stdin as the child is started.
         void pipe_from(const path &from) { in_path=from; }
@@ -146,10 +384,48 @@ namespace c4s {
         static void pipe_global_start(ofstream *po) { if(po) pipe_global=po; }
         //! Stops the global output catching
         static void pipe_global_stop() { pipe_global = 0; }
+#if defined(__linux) || defined(__APPLE__)
+        //! Writes both child's stdout and stderr directly into the given file. (Linux & OSX)
+        void redirect_to(const path &target, bool append=false);
+        //! Writes child's stdout directly into the given file. (Linux & OSX)
+        void redirect_stdout(const path &target, bool append=false);
+        //! Writes child's stderr directly into the given file. (Linux & OSX)
+        void redirect_stderr(const path &target, bool append=false);
+        //! Cancels all file redirections i.e. output is piped to parent again.
+        void redirect_clear();
+        //! Reads child's output into capture buffers instead of the pipe target. Null restores the target.
+        void capture_to(capture_buffer *out, capture_buffer *err=0) { cap_out = out; cap_err = err; }
+        //! Passes child's stdout to the function line by line or in chunks. Empty function restores the pipe target.
+        void on_stdout(output_fn fn, bool lines=true) { out_handler.fn = fn; out_handler.lines = lines; }
+        //! Passes child's stderr to the function line by line or in chunks. Empty function restores the pipe target.
+        void on_stderr(output_fn fn, bool lines=true) { err_handler.fn = fn; err_handler.lines = lines; }
+        //! Returns true if the last run was terminated because an output function asked to stop.
+        bool is_halted() { return halt_sent; }
+        //! Waits are cancelled when the token is cancelled. Null removes the token.
+        void set_cancel(cancel_token *ct) { cancel = ct; }
+#endif
 
 #if defined(__linux) || defined(__APPLE__)
         //! Sets the effective owner for the process. (Linux only)
         void set_user(user *);
+        //! Selects the method used to launch the child. Defaults to default_launch.
+        void set_launch(PROC_LAUNCH pl) { launch = pl; }
+        //! Starts the child in a new process group or session so that stop terminates all of its processes.
+        void set_group(PROC_GROUP pg) { group = pg; }
+        //! Sets the time stop waits after SIGTERM before it sends SIGKILL. Defaults to C4S_PROC_GRACE.
+        void set_grace(std::chrono::milliseconds g) { grace = g; }
+        //! Stops all given processes at once. Total time is the longest grace period instead of the sum.
+        static void stop_all(const std::vector<process*> &procs);
+        //! Sets the scheduling and resource controls for the child. Spawn launch is replaced with fork.
+        void set_controls(const proc_controls &pc) { controls = pc; }
+        //! Returns the controls of the child for modification.
+        proc_controls& get_controls() { return controls; }
+        //! Sets the capacity of the stdout and stderr pipes (Linux). Zero uses the default_pipe_size.
+        void set_pipe_size(size_t ps) { pipe_size = ps; }
+        //! Returns the stdout counters of the last run.
+        const pipe_stats& get_stdout_stats() { return stats_out; }
+        //! Returns the stderr counters of the last run.
+        const pipe_stats& get_stderr_stats() { return stats_err; }
         //! Sets the daemon flag. Use only for attached processes.
         void set_daemon(bool enable) { daemon = enable; }
         //! Returns the pid for this process.
@@ -171,19 +447,29 @@ namespace c4s {
         void start(const char *args=0);
         //! Stops the process i.e. terminates it if it is sill running and closes files.
         void stop();
+        //! Waits for this process to end or untill the given timeout (seconds) is expired.
+        int  wait_for_exit(int timeout) { return wait_for_exit(std::chrono::seconds(timeout)); }
         //! Waits for this process to end or untill the given timeout is expired.
-        int  wait_for_exit(int timeOut);
+        int  wait_for_exit(std::chrono::milliseconds timeout);
         //! Executes command after appending given argument to the current arguments.
         int execa(const char *arg, int timeout=C4S_PROC_TIMEOUT);
         //! Executes the command with optional arguments = calls start and waits for the exit.
         int  exec(int timeout, const char *args=0);
         //! Executes the command with optional arguments = calls start and waits for the exit.
         int  exec(int timeout, const string &);
+        //! Executes the command with optional arguments = calls start and waits for the exit.
+        int  exec(std::chrono::milliseconds timeout, const char *args=0) { start(args); return wait_for_exit(timeout); }
+#ifdef __linux
+        //! Starts the process and lets the process reactor wait for it. Future gives the result.
+        std::future<proc_result> start_async(int timeout=C4S_PROC_TIMEOUT) { return start_async(std::chrono::seconds(timeout)); }
+        //! Starts the process and lets the process reactor wait for it. Future gives the result.
+        std::future<proc_result> start_async(std::chrono::milliseconds timeout);
+#endif
 
         //! Checks if the process is still running.
         bool is_running();
-        //! Returns return value from last execution.
-        int  last_return_value() { return last_ret_val; }
+        //! Returns return value from last execution, or from the exited child that has not been waited for.
+        int  last_return_value();
         //! Enables or disables command echoing before execution.
         void set_echo(bool e) { echo = e; }
 
@@ -194,26 +480,88 @@ namespace c4s {
         //! Static function to get current PID
 #if defined(__linux) || defined(__APPLE__)
         static pid_t get_running_pid() { return getpid(); }
+        //! Returns milliseconds from the monotonic clock. Use for deadlines.
+        static long long now_ms();
+        //! Returns the resource usage of the last completed run. Count is zero if the child was not reaped.
+        const proc_usage& get_usage() { return usage; }
+        //! Returns the resource usage summed over all children reaped by the library.
+        static proc_usage get_total_usage();
+        //! Clears the summed resource usage.
+        static void reset_total_usage();
+        //! Clears the resolved command cache. Call if commands are installed into or removed from PATH.
+        static void refresh_command_cache();
+        //! Collects the exit status of all finished children without blocking. Called by start and the process reactor.
+        static void reap_all();
 #endif
         //! Dumps the process name and arguments into given stream. Use for debugging.
         void dump(ostream &);
 
         static bool no_run;          //1< If true then the command is simply echoed to stdout but not actually run. i.e. dry run.
         static bool nzrv_exception;  //!< If true 'Non-Zero Return Value' causes exception.
+#if defined(__linux) || defined(__APPLE__)
+        static PROC_LAUNCH default_launch; //!< Launch method for new process objects. SPAWN by default, SERVER while the fork_server runs.
+        static size_t default_pipe_size; //!< Pipe capacity for processes without set_pipe_size. Zero keeps the system default.
+#endif
 
     protected:
         //! Initializes process member variables. Called by constructors.
         void init_member_vars();
         void stop_daemon();
+#if defined(__linux) || defined(__APPLE__)
+        bool reap(bool block=false);
+        void track_child();
+        void release_child();
+#ifdef __linux
+        static int reaper_fd();
+        static bool reaper_polling();
+#endif
+        void close_pidfd();
+        static int open_redirect(const path &, bool);
+        void build_argv();
+        void print_args(ostream &os) const;
+        static bool find_in_path(path &cmd);
+        void record_usage(const struct rusage &);
+        void check_halt();
+        void signal_child(int sig, bool reaped);
+        bool wait_gone(long long ms);
+        static void terminate(const std::vector<process*> &procs);
+        static void signal_session(pid_t sid, int sig);
+#endif
 
         path command;               //!< Full path to a command that should be executed.
         stringstream arguments;     //!< Stream of process arguments. Must not contain variables.
+        std::vector<string> argv_list; //!< Arguments as vector. Used instead of arguments stream if use_argv is true.
+        bool use_argv;              //!< If true then argv_list is used as arguments.
 
 #if defined(__linux) || defined(__APPLE__)
         user  *owner;               //!< If defined, process will be executed with user's credentials.
         pid_t pid;
+        int pidfd;                  //!< Process file descriptor for the running child or -1 if not available.
+        unsigned long long reaper_ticket; //!< Key of the child in the reaper table or zero.
         int last_ret_val;
         bool daemon;                //!< If true then the process is to be run as daemon and should not be terminated at class dest
+        PROC_LAUNCH launch;         //!< Method to launch the child.
+        PROC_GROUP group;           //!< Process group of the child. See set_group.
+        std::chrono::milliseconds grace; //!< Time from SIGTERM to SIGKILL in stop.
+        proc_controls controls;     //!< Scheduling and resource controls for the child.
+        path redir_out;             //!< If defined child's stdout is written directly to this file.
+        path redir_err;             //!< If defined child's stderr is written directly to this file.
+        bool redir_append_out;      //!< Append to redir_out instead of truncating it.
+        bool redir_append_err;      //!< Append to redir_err instead of truncating it.
+        bool redir_both;            //!< Stderr is also written into redir_out.
+        capture_buffer *cap_out;    //!< Capture buffer for stdout. See capture_to.
+        capture_buffer *cap_err;    //!< Capture buffer for stderr. See capture_to.
+        output_handler out_handler; //!< Function for stdout. See on_stdout.
+        output_handler err_handler; //!< Function for stderr. See on_stderr.
+        bool halt_sent;             //!< Child has been sent SIGTERM because of an output function.
+        cancel_token *cancel;       //!< If set, cancels the wait. See set_cancel.
+        int link_in;                //!< If not -1, used as child's stdin at next start. Set by pipeline.
+        int link_out;               //!< If not -1, used as child's stdout at next start. Set by pipeline.
+        std::vector<char*> argv_ptr; //!< Argument vector for exec. Rebuilt only when command or arguments change.
+        std::vector<char> argv_buffer; //!< Tokenized argument string that argv_ptr points to.
+        string argv_cmd;            //!< Command path that argv_ptr[0] points to.
+        string argv_source;         //!< Argument string that argv_buffer was built from.
+        bool argv_dirty;            //!< True if argv_list has changed since argv_ptr was built.
 #else
         HANDLE pid;
         HANDLE output;
@@ -224,7 +572,22 @@ namespace c4s {
         path in_path;               //!< If defined and exists, files content will be used as input to process.
         proc_pipes *pipes;          //!< Pipe to child for input and output. Valid when child is running.
         static ofstream *pipe_global; //!< Global pipe target
+#if defined(__linux) || defined(__APPLE__)
+        static std::map<string,string> command_cache; //!< Command names resolved from PATH. Guarded by a mutex.
+        static string command_cache_env;  //!< PATH value that command_cache is valid for.
+        proc_usage usage;           //!< Resource usage of the last run.
+        size_t pipe_size;           //!< Requested pipe capacity or zero. See set_pipe_size.
+        pipe_stats stats_out;       //!< Stdout counters of the last run.
+        pipe_stats stats_err;       //!< Stderr counters of the last run.
+        static proc_usage total_usage; //!< Resource usage of all children.
+#endif
         bool echo;                  //!< If true then the commands are echoed to stdout before starting them. Use for debugging.
+#if defined(__linux) || defined(__APPLE__)
+        friend class process_group;
+        friend class pipeline;
+        friend class process_reactor;
+        friend class process_cache;
+#endif
     };
 
 }
@@ -0,0 +1,466 @@
+/*******************************************************************************
+c4s_process_cache.cpp
+Implementation for process_cache-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifdef C4S_LIB_BUILD
+ #include <string.h>
+ #include <stdio.h>
+ #include <iostream>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <sys/stat.h>
+ #include <mutex>
+ #include "c4s_config.hpp"
+ #include "c4s_exception.hpp"
+ #include "c4s_path.hpp"
+ #include "c4s_path_list.hpp"
+ #include "c4s_capture.hpp"
+ #include "c4s_process.hpp"
+ #include "c4s_process_cache.hpp"
+ #include "c4s_util.hpp"
+ using namespace c4s;
+#endif
+
+// ==================================================================================================
+// ###############################  SHA256  #########################################################
+// ==================================================================================================
+static const unsigned int sha256_k[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+#define SHA_ROR(x,n) (((x)>>(n))|((x)<<(32-(n))))
+
+// ==================================================================================================
+void c4s::sha256::reset()
+{
+    state[0] = 0x6a09e667; state[1] = 0xbb67ae85; state[2] = 0x3c6ef372; state[3] = 0xa54ff53a;
+    state[4] = 0x510e527f; state[5] = 0x9b05688c; state[6] = 0x1f83d9ab; state[7] = 0x5be0cd19;
+    total = 0;
+}
+
+// ==================================================================================================
+void c4s::sha256::transform(const unsigned char *block)
+{
+    unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+    for(int i=0; i<16; i++)
+        w[i] = (block[i*4]<<24)|(block[i*4+1]<<16)|(block[i*4+2]<<8)|block[i*4+3];
+    for(int i=16; i<64; i++) {
+        unsigned int s0 = SHA_ROR(w[i-15],7) ^ SHA_ROR(w[i-15],18) ^ (w[i-15]>>3);
+        unsigned int s1 = SHA_ROR(w[i-2],17) ^ SHA_ROR(w[i-2],19) ^ (w[i-2]>>10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for(int i=0; i<64; i++) {
+        t1 = h + (SHA_ROR(e,6) ^ SHA_ROR(e,11) ^ SHA_ROR(e,25)) + ((e&f) ^ (~e&g)) + sha256_k[i] + w[i];
+        t2 = (SHA_ROR(a,2) ^ SHA_ROR(a,13) ^ SHA_ROR(a,22)) + ((a&b) ^ (a&c) ^ (b&c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+// ==================================================================================================
+void c4s::sha256::update(const void *data, size_t len)
+{
+    const unsigned char *ptr = (const unsigned char*)data;
+    size_t used = total%64;
+    total += len;
+    if(used) {
+        size_t fill = 64-used < len ? 64-used : len;
+        memcpy(buffer+used, ptr, fill);
+        ptr += fill;
+        len -= fill;
+        if(used+fill < 64)
+            return;
+        transform(buffer);
+    }
+    for(; len>=64; ptr+=64, len-=64)
+        transform(ptr);
+    if(len)
+        memcpy(buffer, ptr, len);
+}
+
+// ==================================================================================================
+bool c4s::sha256::update_file(const path &file)
+{
+    char rb[0x10000];
+    ssize_t br;
+    int fd = open(file.get_path().c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd == -1)
+        return false;
+    while((br = read(fd, rb, sizeof(rb))) != 0) {
+        if(br<0) {
+            if(errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        update(rb, br);
+    }
+    close(fd);
+    return true;
+}
+
+// ==================================================================================================
+string c4s::sha256::final()
+{
+    const char *hex = "0123456789abcdef";
+    unsigned char pad[72];
+    unsigned long long bits = total*8;
+    size_t padlen = (total%64 < 56 ? 56 : 120) - total%64;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for(int i=0; i<8; i++)
+        pad[padlen+i] = (unsigned char)(bits>>(56-i*8));
+    update(pad, padlen+8);
+    string digest;
+    for(int i=0; i<8; i++) {
+        for(int s=28; s>=0; s-=4)
+            digest += hex[(state[i]>>s)&0xf];
+    }
+    reset();
+    return digest;
+}
+
+// ==================================================================================================
+// ###############################  PROCESS_CACHE  ##################################################
+// ==================================================================================================
+std::map<string,string> c4s::process_cache::binary_hashes;
+static std::mutex binary_lock;   // Guards binary_hashes. Caches may be used from several threads.
+
+// ==================================================================================================
+c4s::process_cache::process_cache(const path &dir)
+/*! \param dir Cache directory. Only the directory part is used.
+ */
+{
+    cache_dir.set_dir(dir.get_dir());
+    if(!cache_dir.dirname_exists())
+        cache_dir.mkdir();
+    cache_failures = false;
+    hit = false;
+}
+
+// ==================================================================================================
+void c4s::process_cache::add_inputs(path_list &list)
+{
+    for(path_iterator pi=list.begin(); pi!=list.end(); pi++)
+        inputs.push_back(*pi);
+}
+
+// ==================================================================================================
+string c4s::process_cache::file_hash(const path &file)
+/*! \retval string Hash of the file content or empty string if the file cannot be read.
+ */
+{
+    sha256 sha;
+    if(!sha.update_file(file))
+        return string();
+    return sha.final();
+}
+
+// ==================================================================================================
+string c4s::process_cache::key(process &proc)
+/*! Command binary is hashed only once per size and modification time.
+  \retval string Cache key as hex string.
+*/
+{
+    sha256 sha;
+    struct stat sbuf;
+    string cmd = proc.command.get_path();
+    ostringstream id;
+
+    sha.update(string("c4s-process-cache-1"));
+    if(stat(cmd.c_str(), &sbuf) == -1)
+        throw process_exception("process_cache::key - Unable to read the command: "+cmd);
+    id << cmd<<':'<<sbuf.st_size<<':'<<sbuf.st_mtime<<':'<<sbuf.st_ino;
+    string binary_hash;
+    {
+        std::lock_guard<std::mutex> guard(binary_lock);
+        std::map<string,string>::iterator bi = binary_hashes.find(id.str());
+        if(bi != binary_hashes.end())
+            binary_hash = bi->second;
+    }
+    if(binary_hash.empty()) {
+        // Hashed without the lock. Concurrent misses store the same value.
+        binary_hash = file_hash(proc.command);
+        std::lock_guard<std::mutex> guard(binary_lock);
+        binary_hashes[id.str()] = binary_hash;
+    }
+    sha.update(cmd);
+    sha.update(binary_hash);
+
+    proc.build_argv();
+    sha.update(string("args"));
+    for(size_t ndx=1; ndx+1<proc.argv_ptr.size(); ndx++)
+        sha.update(string(proc.argv_ptr[ndx]));
+
+    sha.update(string("env"));
+    for(std::vector<string>::iterator ei=envs.begin(); ei!=envs.end(); ei++) {
+        const char *value = getenv(ei->c_str());
+        sha.update(*ei);
+        sha.update(value ? string("=")+value : string("-"));
+    }
+    sha.update(string("in"));
+    if(!proc.in_path.empty()) {
+        sha.update(proc.in_path.get_path());
+        sha.update(file_hash(proc.in_path));
+    }
+    for(std::vector<path>::iterator ii=inputs.begin(); ii!=inputs.end(); ii++) {
+        sha.update(ii->get_path());
+        sha.update(file_hash(*ii));
+    }
+    sha.update(string("out"));
+    for(std::vector<path>::iterator oi=outputs.begin(); oi!=outputs.end(); oi++)
+        sha.update(oi->get_path());
+    sha.update(string("redirect"));
+    sha.update(proc.redir_out.get_path());
+    sha.update(string(proc.redir_both ? "both" : "-"));
+    sha.update(proc.redir_err.get_path());
+    return sha.final();
+}
+
+// ==================================================================================================
+path c4s::process_cache::object_path(const string &hash)
+{
+    path obj;
+    obj.set_dir(append_slash(cache_dir.get_dir())+"objects"+C4S_DSEP+hash.substr(0,2));
+    obj.set_base(hash);
+    return obj;
+}
+
+// ==================================================================================================
+path c4s::process_cache::entry_path(const string &key)
+{
+    path entry;
+    entry.set_dir(append_slash(cache_dir.get_dir())+"entries"+C4S_DSEP+key.substr(0,2));
+    entry.set_base(key);
+    return entry;
+}
+
+// ==================================================================================================
+string c4s::process_cache::store(const string &data)
+/*! Stores the data as an object unless the same content is already there.
+  \retval string Hash of the data.
+*/
+{
+    sha256 sha;
+    sha.update(data.data(), data.size());
+    string hash = sha.final();
+    path obj = object_path(hash);
+    if(obj.exists())
+        return hash;
+    if(!obj.dirname_exists())
+        obj.mkdir();
+    string tmp = obj.get_path()+".tmp";
+    ofstream of(tmp.c_str(), ios::binary|ios::trunc);
+    of.write(data.data(), data.size());
+    of.close();
+    if(!of || rename(tmp.c_str(), obj.get_path().c_str()) == -1) {
+        unlink(tmp.c_str());
+        throw process_exception("process_cache::store - Unable to write object: "+obj.get_path());
+    }
+    return hash;
+}
+
+// ==================================================================================================
+string c4s::process_cache::store(const path &file)
+/*! Stores the file as an object unless the same content is already there.
+  \retval string Hash of the file.
+*/
+{
+    string hash = file_hash(file);
+    if(hash.empty())
+        throw process_exception("process_cache::store - Unable to read output: "+file.get_path());
+    path obj = object_path(hash);
+    if(obj.exists())
+        return hash;
+    if(!obj.dirname_exists())
+        obj.mkdir();
+    path tmp(obj);
+    tmp.set_base(hash+".tmp");
+    file.cp(tmp, PCF_FORCE|PCF_DEFPERM);
+    if(rename(tmp.get_path().c_str(), obj.get_path().c_str()) == -1) {
+        tmp.rm();
+        throw process_exception("process_cache::store - Unable to write object: "+obj.get_path());
+    }
+    return hash;
+}
+
+// ==================================================================================================
+void c4s::process_cache::write_object(const string &hash, ostream &os)
+{
+    char rb[0x4000];
+    ifstream obj(object_path(hash).get_path().c_str(), ios::binary);
+    while(obj.read(rb, sizeof(rb)) || obj.gcount()>0)
+        os.write(rb, obj.gcount());
+}
+
+// ==================================================================================================
+bool c4s::process_cache::restore(process &proc, const path &entry)
+/*! Restores the results recorded in the entry. If any of the objects is missing nothing is restored.
+  \retval bool True if the results were restored.
+*/
+{
+    ifstream ef(entry.get_path().c_str());
+    string line, out_hash, err_hash;
+    std::vector<std::pair<string,string>> files;
+    std::vector<int> modes;
+    int rv = 0;
+
+    if(!ef || !getline(ef, line) || line != "c4s-process-cache 1")
+        return false;
+    while(getline(ef, line)) {
+        istringstream ls(line);
+        string tag;
+        ls >> tag;
+        if(tag == "rv")
+            ls >> rv;
+        else if(tag == "stdout")
+            ls >> out_hash;
+        else if(tag == "stderr")
+            ls >> err_hash;
+        else if(tag == "output") {
+            string hash, name;
+            int mode;
+            ls >> hash >> oct >> mode;
+            ls.get();
+            getline(ls, name);
+            files.push_back(std::make_pair(hash, name));
+            modes.push_back(mode);
+        }
+    }
+    if(out_hash.empty() || err_hash.empty() || !object_path(out_hash).exists() || !object_path(err_hash).exists())
+        return false;
+    for(size_t ndx=0; ndx<files.size(); ndx++) {
+        if(!object_path(files[ndx].first).exists())
+            return false;
+    }
+
+    for(size_t ndx=0; ndx<files.size(); ndx++) {
+        path target(files[ndx].second);
+        object_path(files[ndx].first).cp(target, PCF_FORCE|PCF_DEFPERM);
+        ::chmod(target.get_path().c_str(), modes[ndx]);
+    }
+    ostream *pipe = process::pipe_global ? process::pipe_global : proc.pipe_target;
+    if(pipe) {
+        write_object(out_hash, *pipe);
+        write_object(err_hash, *pipe);
+    }
+    proc.last_ret_val = rv;
+    return true;
+}
+
+// ==================================================================================================
+int c4s::process_cache::exec(process &proc, int timeout)
+/*! Output is written into the process' pipe target in both cases. Stdout is written before stderr since
+  they are captured separately.
+  \param proc Process to run. Command and arguments must have been set.
+  \param timeout Number of seconds to wait if the process is run.
+  \retval int Return value of the process.
+*/
+{
+    hit = false;
+    if(process::no_run)
+        return proc.exec(timeout);
+    // Appended redirect depends on the earlier content of the file.
+    if((!proc.redir_out.empty() && proc.redir_append_out) || (!proc.redir_err.empty() && proc.redir_append_err))
+        return proc.exec(timeout);
+    string k = key(proc);
+    path entry = entry_path(k);
+    if(entry.exists() && restore(proc, entry)) {
+        hit = true;
+        if(process::nzrv_exception && proc.last_ret_val) {
+            ostringstream os;
+            os << "Process: '"<<proc.command.get_base()<<"' retured:"<<proc.last_ret_val<<" (cached)";
+            throw process_exception(os.str());
+        }
+        return proc.last_ret_val;
+    }
+
+    // Miss. Run with captured output.
+    capture_buffer out, err;
+    capture_buffer *prev_out = proc.cap_out, *prev_err = proc.cap_err;
+    int rv;
+    proc.capture_to(&out, &err);
+    try {
+        rv = proc.exec(timeout);
+    }catch(const process_exception &) {
+        proc.capture_to(prev_out, prev_err);
+        throw;
+    }
+    proc.capture_to(prev_out, prev_err);
+    ostream *pipe = process::pipe_global ? process::pipe_global : proc.pipe_target;
+    if(pipe) {
+        out.write_to(*pipe);
+        err.write_to(*pipe);
+    }
+    if(rv && !cache_failures)
+        return rv;
+    std::vector<path> files(outputs);
+    if(!proc.redir_out.empty())
+        files.push_back(proc.redir_out);
+    if(!proc.redir_err.empty())
+        files.push_back(proc.redir_err);
+    for(std::vector<path>::iterator oi=files.begin(); oi!=files.end(); oi++) {
+        if(!oi->exists())
+            return rv;  // Cannot be restored later.
+    }
+
+    ostringstream record;
+    record << "c4s-process-cache 1\n";
+    record << "rv "<<rv<<'\n';
+    record << "stdout "<<store(out.str())<<'\n';
+    record << "stderr "<<store(err.str())<<'\n';
+    for(std::vector<path>::iterator oi=files.begin(); oi!=files.end(); oi++) {
+        struct stat sbuf;
+        stat(oi->get_path().c_str(), &sbuf);
+        record << "output "<<store(*oi)<<' '<<oct<<(sbuf.st_mode&07777)<<dec<<' '<<oi->get_path()<<'\n';
+    }
+    if(!entry.dirname_exists())
+        entry.mkdir();
+    string tmp = entry.get_path()+".tmp";
+    ofstream ef(tmp.c_str(), ios::trunc);
+    ef << record.str();
+    ef.close();
+    if(!ef || rename(tmp.c_str(), entry.get_path().c_str()) == -1) {
+        unlink(tmp.c_str());
+        throw process_exception("process_cache::exec - Unable to write entry: "+entry.get_path());
+    }
+    return rv;
+}
+
+// ==================================================================================================
+void c4s::process_cache::purge()
+{
+    path objects, entries;
+    objects.set_dir(append_slash(cache_dir.get_dir())+"objects");
+    entries.set_dir(append_slash(cache_dir.get_dir())+"entries");
+    if(objects.dirname_exists())
+        objects.rmdir(true);
+    if(entries.dirname_exists())
+        entries.rmdir(true);
+}
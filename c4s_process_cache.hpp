@@ -0,0 +1,110 @@
+/*******************************************************************************
+c4s_process_cache.hpp
+Defines process_cache-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifndef C4S_PROCESS_CACHE_HPP
+#define C4S_PROCESS_CACHE_HPP
+
+#include <vector>
+
+namespace c4s {
+
+    // ----------------------------------------------------------------------------------------------------
+    //! SHA-256 message digest.
+    class sha256
+    {
+    public:
+        sha256() { reset(); }
+        //! Starts a new digest.
+        void reset();
+        //! Adds data to the digest.
+        void update(const void *data, size_t len);
+        //! Adds a string and its terminating zero to the digest. Zero separates consecutive strings.
+        void update(const string &str) { update(str.c_str(), str.size()+1); }
+        //! Adds the file content to the digest. \retval bool False if the file could not be read.
+        bool update_file(const path &);
+        //! Finishes the digest. \retval string Digest as lowercase hex string.
+        string final();
+
+    protected:
+        void transform(const unsigned char *block);
+        unsigned int state[8];
+        unsigned char buffer[64];
+        unsigned long long total;
+    };
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Executes processes through a result cache. (Linux & OSX)
+    /*! Cache key is a SHA-256 over the command binary, the argument vector, the declared environment
+      variables, the content of the declared input files and the names of the declared outputs. Files that
+      stdout and stderr are redirected into are handled as outputs. Processes that append to a redirect
+      file are always run. On a hit the stored stdout, stderr and output files are restored and the return
+      value is set without running the command. On a miss the command is run and, if it succeeded, the
+      results are stored. Data is stored in the cache directory by content hash under 'objects' and the run
+      records under 'entries'. Use only for deterministic commands whose results depend on the declared
+      inputs alone.
+    */
+    class process_cache
+    {
+    public:
+        //! Creates a cache into the given directory. Directory is created if it does not exist.
+        process_cache(const path &dir);
+
+        //! Includes the value of the environment variable into the key.
+        void add_env(const char *name) { envs.push_back(name); }
+        //! Declares an input file. Its content is included into the key.
+        void add_input(const path &p) { inputs.push_back(p); }
+        //! Declares all files in the list as inputs.
+        void add_inputs(path_list &);
+        //! Declares an output file. Output files are stored on a miss and restored on a hit.
+        void add_output(const path &p) { outputs.push_back(p); }
+        //! Clears the declared environment, inputs and outputs.
+        void clear() { envs.clear(); inputs.clear(); outputs.clear(); }
+        //! If set, results with a non-zero return value are cached as well.
+        void set_cache_failures(bool cf) { cache_failures = cf; }
+
+        //! Runs the process or restores its results from the cache. \retval int Return value.
+        int exec(process &, int timeout=C4S_PROC_TIMEOUT);
+        //! Returns true if the last exec was served from the cache.
+        bool was_hit() { return hit; }
+        //! Calculates the cache key for the process with current declarations.
+        string key(process &);
+        //! Removes all entries and objects from the cache.
+        void purge();
+
+    protected:
+        string file_hash(const path &);
+        path object_path(const string &hash);
+        path entry_path(const string &key);
+        string store(const string &data);
+        string store(const path &file);
+        void write_object(const string &hash, ostream &);
+        bool restore(process &, const path &entry);
+
+        path cache_dir;
+        std::vector<string> envs;
+        std::vector<path> inputs;
+        std::vector<path> outputs;
+        bool cache_failures;
+        bool hit;
+        //! Hashes of command binaries keyed by path, size and modification time. Guarded by a mutex.
+        static std::map<string,string> binary_hashes;
+    };
+}
+#endif
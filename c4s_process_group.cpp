@@ -0,0 +1,351 @@
+/*******************************************************************************
+c4s_process_group.cpp
+Implementation for process_group-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifdef C4S_LIB_BUILD
+ #include <string.h>
+ #include <iostream>
+ #include <sys/wait.h>
+ #include <unistd.h>
+ #include <poll.h>
+ #include "c4s_config.hpp"
+ #include "c4s_exception.hpp"
+ #include "c4s_path.hpp"
+ #include "c4s_path_list.hpp"
+ #include "c4s_process.hpp"
+ #include "c4s_process_group.hpp"
+ using namespace c4s;
+#endif
+extern char **environ;
+
+// ==================================================================================================
+c4s::process_group::process_group(ostream *out)
+/*! \param out Stream for the job outputs. See pipe_to.
+ */
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    max_jobs = cpus>0 ? (unsigned int)cpus : 1;
+    emitted = 0;
+    pipe_target = out;
+    cancel = 0;
+    use_controls = false;
+}
+
+// ==================================================================================================
+c4s::process_group::~process_group()
+{
+    clear();
+}
+
+// ==================================================================================================
+void c4s::process_group::clear()
+{
+    std::vector<process*> procs;
+    for(std::vector<job*>::iterator ji=jobs.begin(); ji!=jobs.end(); ji++)
+        procs.push_back(&(*ji)->proc);
+    process::stop_all(procs);
+    for(std::vector<job*>::iterator ji=jobs.begin(); ji!=jobs.end(); ji++)
+        delete *ji;
+    jobs.clear();
+    emitted = 0;
+}
+
+// ==================================================================================================
+size_t c4s::process_group::add(const char *cmd, const char *args)
+/*! Command is searched from the path at this point. Process exception is thrown if it is not found.
+  \param cmd Command to execute.
+  \param args Arguments for the command.
+*/
+{
+    job *nj = new job;
+    try {
+        nj->proc.set_command(cmd);
+    }catch(const process_exception &) {
+        delete nj;
+        throw;
+    }
+    if(args)
+        nj->proc.set_args(args);
+    nj->deadline = 0;
+    nj->rv = 0;
+    nj->running = false;
+    nj->done = false;
+    nj->timeout = false;
+    nj->cancelled = false;
+    jobs.push_back(nj);
+    return jobs.size()-1;
+}
+
+// ==================================================================================================
+size_t c4s::process_group::add(const string &cmd, const string &args)
+{
+    return add(cmd.c_str(), args.empty() ? 0 : args.c_str());
+}
+
+// ==================================================================================================
+size_t c4s::process_group::add(const string &cmd, const std::vector<string> &argv)
+/*! Arguments are passed to the command as they are. See process::set_argv.
+ */
+{
+    size_t ndx = add(cmd.c_str());
+    jobs.at(ndx)->proc.set_argv(argv);
+    return ndx;
+}
+
+// ==================================================================================================
+size_t c4s::process_group::add_xargs(const string &cmd, const std::vector<string> &prefix, path_list &files,
+                                     size_t max_args)
+/*! Same as xargs. Each file in the list is appended to the prefix arguments. Files are packed into as few
+  jobs as the system argument size limit (ARG_MAX) allows. Jobs are run with run-function which executes
+  them in parallel unless max jobs has been set to one. Return values are then aggregated by run.
+  Process exception is thrown if the command is not found or a single path does not fit into the limit.
+  \param cmd Command to execute.
+  \param prefix Arguments that precede the files in each job.
+  \param files List of files to process.
+  \param max_args Maximum number of files per job. Zero for no limit other than ARG_MAX.
+  \retval size_t Number of jobs added.
+*/
+{
+    size_t limit = arg_space();
+    size_t used, count=0;
+    if(files.empty())
+        return 0;
+
+    // Resolved command path, prefix and terminating null pointer take space in every job.
+    size_t first = add(cmd.c_str());
+    size_t base = jobs[first]->proc.command.get_path().size()+1+2*sizeof(char*);
+    for(std::vector<string>::const_iterator ai=prefix.begin(); ai!=prefix.end(); ai++)
+        base += ai->size()+1+sizeof(char*);
+    for(path_iterator pi=files.begin(); pi!=files.end(); pi++) {
+        if(base+pi->get_path().size()+1+sizeof(char*) > limit) {
+            delete jobs.back();
+            jobs.pop_back();
+            ostringstream os;
+            os << "process_group::add_xargs - Path does not fit into the argument space: "<<pi->get_path();
+            throw process_exception(os.str());
+        }
+    }
+
+    std::vector<string> argv(prefix);
+    used = base;
+    for(path_iterator pi=files.begin(); pi!=files.end(); pi++) {
+        string file = pi->get_path();
+        size_t cost = file.size()+1+sizeof(char*);
+        if(count>0 && (used+cost > limit || (max_args && count==max_args))) {
+            jobs.back()->proc.set_argv(argv);
+            add(cmd.c_str());
+            argv.resize(prefix.size());
+            used = base;
+            count = 0;
+        }
+        argv.push_back(file);
+        used += cost;
+        count++;
+    }
+    jobs.back()->proc.set_argv(argv);
+    return jobs.size()-first;
+}
+
+// ==================================================================================================
+size_t c4s::process_group::arg_space()
+/*! Space is ARG_MAX minus the size of the current environment and 2048 bytes of headroom like in POSIX
+  xargs. The environment is counted because it is passed to the children as well.
+  \retval size_t Number of bytes available for the command and its arguments including the pointers.
+*/
+{
+    long am = sysconf(_SC_ARG_MAX);
+    size_t space = am>0 ? (size_t)am : 0x20000;
+    size_t env = 0;
+    for(char **ep=environ; ep && *ep; ep++)
+        env += strlen(*ep)+1+sizeof(char*);
+    env += 2048;
+    if(env+0x1000 > space)
+        return 0x1000;
+    return space-env;
+}
+
+// ==================================================================================================
+void c4s::process_group::start_job(job *jb, long long timeout)
+/*! \param timeout Milliseconds the job is allowed to run.
+ */
+{
+    jb->out.str("");
+    jb->err.str("");
+    jb->rv = 0;
+    jb->done = false;
+    jb->timeout = false;
+    jb->cancelled = false;
+    if(use_controls)
+        jb->proc.set_controls(controls);
+    jb->proc.start();
+    if(!jb->proc.pid) {
+        // Dry run i.e. process::no_run
+        jb->done = true;
+        return;
+    }
+    jb->running = true;
+    jb->deadline = process::now_ms() + timeout;
+}
+
+// ==================================================================================================
+void c4s::process_group::finish_job(job *jb)
+/*! Collects the remaining output and releases the process resources after the child has exited.
+ */
+{
+    process &pr = jb->proc;
+    pr.pipes->read_child_stdout(&jb->out);
+    pr.pipes->read_child_stderr(&jb->err);
+    jb->rv = pr.last_ret_val;
+    pr.pid = 0;
+    pr.stop();
+    jb->running = false;
+    jb->done = true;
+}
+
+// ==================================================================================================
+void c4s::process_group::emit_done()
+/*! Writes outputs of completed jobs into pipe target in the order the jobs were added.
+ */
+{
+    while(emitted<jobs.size() && jobs[emitted]->done) {
+        if(pipe_target) {
+            *pipe_target << jobs[emitted]->out.str();
+            *pipe_target << jobs[emitted]->err.str();
+        }
+        emitted++;
+    }
+}
+
+// ==================================================================================================
+int c4s::process_group::run(std::chrono::milliseconds timeout)
+/*! Starts the jobs in the order they were added, keeping at most max_jobs processes running at the same
+  time. Function returns when all jobs have completed. A job that exceeds the timeout is terminated and
+  its timeout flag is set. If the cancel token is cancelled, running jobs are terminated, the rest are
+  skipped and their cancelled flag is set. The group can be run again after this function returns.
+  \param timeout Time each job is allowed to run.
+  \retval int Number of jobs that failed i.e. returned non-zero value, timed out or were cancelled.
+*/
+{
+    std::vector<struct pollfd> pfd;
+    std::vector<job*> active;
+    size_t next=0;
+    int failed=0;
+
+    emitted = 0;
+    while(next<jobs.size() || !active.empty()) {
+        if(cancel && cancel->is_cancelled()) {
+            std::vector<process*> procs;
+            for(std::vector<job*>::iterator ai=active.begin(); ai!=active.end(); ai++)
+                procs.push_back(&(*ai)->proc);
+            process::stop_all(procs);
+            for(std::vector<job*>::iterator ai=active.begin(); ai!=active.end(); ai++) {
+                (*ai)->rv = (*ai)->proc.last_ret_val;
+                (*ai)->running = false;
+                (*ai)->done = true;
+                (*ai)->cancelled = true;
+            }
+            active.clear();
+            for(; next<jobs.size(); next++) {
+                job *jb = jobs[next];
+                jb->out.str("");
+                jb->err.str("");
+                jb->rv = 0;
+                jb->timeout = false;
+                jb->done = true;
+                jb->cancelled = true;
+            }
+            break;
+        }
+        while(active.size()<max_jobs && next<jobs.size()) {
+            job *jb = jobs[next++];
+            start_job(jb, timeout.count());
+            if(jb->running)
+                active.push_back(jb);
+        }
+        emit_done();
+        if(active.empty())
+            continue;
+
+        // Wait for output or exit from any of the running jobs.
+        long long now = process::now_ms();
+        long long delay = timeout.count();
+        bool tick = false;
+        pfd.resize(active.size()*4+1);
+        for(size_t ndx=0; ndx<active.size(); ndx++) {
+            process &pr = active[ndx]->proc;
+            pfd[ndx*4].fd = pr.pipes->get_fd_out();
+            pfd[ndx*4+1].fd = pr.pipes->get_fd_err();
+            pfd[ndx*4+2].fd = pr.pidfd;
+            pfd[ndx*4+3].fd = pr.pipes->get_fd_in();
+            if(pr.pidfd<0)
+                tick = true;
+            if(active[ndx]->deadline-now < delay)
+                delay = active[ndx]->deadline-now;
+        }
+        pfd.back().fd = cancel ? cancel->get_fd() : -1;
+        for(size_t ndx=0; ndx<pfd.size(); ndx++) {
+            pfd[ndx].events = ndx%4==3 ? POLLOUT : POLLIN;
+            pfd[ndx].revents = 0;
+        }
+        if(delay<0)
+            delay = 0;
+        if(tick && delay>PROC_POLL_TICK)
+            delay = PROC_POLL_TICK;
+        if(poll(&pfd[0], pfd.size(), (int)delay) == -1 && errno != EINTR) {
+            ostringstream os;
+            os << "process_group::run - poll error: "<<strerror(errno);
+            throw process_exception(os.str());
+        }
+
+        // Collect output and finished jobs.
+        now = process::now_ms();
+        size_t pos=0;
+        for(size_t ndx=0; ndx<active.size(); ndx++) {
+            job *jb = active[ndx];
+            process &pr = jb->proc;
+            if(pfd[ndx*4].revents)
+                pr.pipes->read_child_stdout(&jb->out);
+            if(pfd[ndx*4+1].revents)
+                pr.pipes->read_child_stderr(&jb->err);
+            if(pfd[ndx*4+3].revents & (POLLERR|POLLHUP))
+                pr.pipes->close_child_input();
+            else if(pfd[ndx*4+3].revents)
+                pr.pipes->feed_child_input();
+            pr.check_halt();
+            if(pr.reap())
+                finish_job(jb);
+            else if(now >= jb->deadline) {
+                pr.stop();
+                jb->rv = pr.last_ret_val;
+                jb->running = false;
+                jb->done = true;
+                jb->timeout = true;
+            }
+            else
+                active[pos++] = jb;
+        }
+        active.resize(pos);
+    }
+    emit_done();
+    for(std::vector<job*>::iterator ji=jobs.begin(); ji!=jobs.end(); ji++) {
+        if((*ji)->timeout || (*ji)->cancelled || (*ji)->rv)
+            failed++;
+    }
+    return failed;
+}
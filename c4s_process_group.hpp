@@ -0,0 +1,112 @@
+/*******************************************************************************
+c4s_process_group.hpp
+Defines process_group-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifndef C4S_PROCESS_GROUP_HPP
+#define C4S_PROCESS_GROUP_HPP
+
+#include <vector>
+
+namespace c4s {
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Runs a set of processes in parallel. (Linux & OSX)
+    /*! Jobs are added to the group with add-functions and then run with run-function. At most max_jobs
+      processes are running at the same time. Each job's stdout and stderr are buffered separately. When a
+      job and all jobs added before it have completed, its output is written to the group's pipe target.
+      This keeps the output in the same order as the jobs were added. Exit codes are available per job
+      after the run.
+    */
+    class process_group
+    {
+    public:
+        //! Creates an empty group. Parallelism defaults to the number of online CPUs.
+        process_group(ostream *out=0);
+        //! Deletes the jobs. Running processes are terminated.
+        ~process_group();
+
+        //! Adds a new job into the group. \retval size_t Index of the job.
+        size_t add(const char *cmd, const char *args=0);
+        //! Adds a new job into the group. \retval size_t Index of the job.
+        size_t add(const string &cmd, const string &args);
+        //! Adds a new job into the group. \retval size_t Index of the job.
+        size_t add(const string &cmd, const std::vector<string> &argv);
+        //! Adds jobs that run the command over the files in as few invocations as ARG_MAX allows.
+        size_t add_xargs(const string &cmd, const std::vector<string> &prefix, path_list &files,
+                         size_t max_args=0);
+        //! Removes all jobs from the group.
+        void clear();
+        //! Returns the number of jobs in the group.
+        size_t size() { return jobs.size(); }
+
+        //! Sets the maximum number of simultaneously running processes.
+        void set_max_jobs(unsigned int mj) { max_jobs = mj>0 ? mj : 1; }
+        //! Returns the maximum number of simultaneously running processes.
+        unsigned int get_max_jobs() { return max_jobs; }
+        //! Sets the stream where job outputs are written in job order. Null keeps output in job buffers only.
+        void pipe_to(ostream *out) { pipe_target = out; }
+        //! Run is cancelled when the token is cancelled. Null removes the token.
+        void set_cancel(cancel_token *ct) { cancel = ct; }
+        //! Sets the scheduling and resource controls for every job. Overrides the controls of job processes.
+        void set_controls(const proc_controls &pc) { controls = pc; use_controls = true; }
+
+        //! Runs all jobs. Timeout (seconds) is applied to each job separately.
+        int run(int timeout=C4S_PROC_TIMEOUT) { return run(std::chrono::seconds(timeout)); }
+        //! Runs all jobs. Timeout is applied to each job separately.
+        int run(std::chrono::milliseconds timeout);
+
+        //! Returns access to job's process e.g. for setting the user or launch method before run.
+        process& get_process(size_t ndx) { return jobs.at(ndx)->proc; }
+        //! Returns the job's return value as given by process::last_return_value.
+        int get_return_value(size_t ndx) { return jobs.at(ndx)->rv; }
+        //! Returns true if the job was terminated because of timeout.
+        bool is_timeout(size_t ndx) { return jobs.at(ndx)->timeout; }
+        //! Returns true if the job was terminated or skipped because the run was cancelled.
+        bool is_cancelled(size_t ndx) { return jobs.at(ndx)->cancelled; }
+        //! Returns the captured stdout of the job.
+        string get_stdout(size_t ndx) { return jobs.at(ndx)->out.str(); }
+        //! Returns the captured stderr of the job.
+        string get_stderr(size_t ndx) { return jobs.at(ndx)->err.str(); }
+
+    protected:
+        struct job {
+            process proc;
+            ostringstream out, err;
+            long long deadline;
+            int  rv;
+            bool running;
+            bool done;
+            bool timeout;
+            bool cancelled;
+        };
+        void start_job(job *, long long timeout);
+        void finish_job(job *);
+        void emit_done();
+        static size_t arg_space();
+
+        std::vector<job*> jobs;
+        unsigned int max_jobs;  //!< Maximum number of running processes.
+        size_t emitted;         //!< Number of jobs whose output has been written into pipe target.
+        ostream *pipe_target;   //!< Target for job outputs.
+        cancel_token *cancel;   //!< If set, cancels the run. See set_cancel.
+        proc_controls controls; //!< Controls for all jobs if use_controls is set.
+        bool use_controls;
+    };
+}
+#endif
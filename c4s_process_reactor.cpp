@@ -0,0 +1,362 @@
+/*******************************************************************************
+c4s_process_reactor.cpp
+Implementation for process_reactor-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifdef C4S_LIB_BUILD
+ #include <string.h>
+ #include <iostream>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <sys/epoll.h>
+ #include <sys/eventfd.h>
+ #include "c4s_config.hpp"
+ #include "c4s_exception.hpp"
+ #include "c4s_path.hpp"
+ #include "c4s_process.hpp"
+ #include "c4s_process_reactor.hpp"
+ using namespace c4s;
+#endif
+
+#ifdef __linux
+// Kinds of file descriptors registered for each child. Stored in the low bits of the epoll data.
+const unsigned long long RFD_OUT=0, RFD_ERR=1, RFD_PID=2, RFD_IN=3, RFD_CANCEL=4, RFD_BITS=3;
+// Epoll data of the wake-up eventfd and the child reaper. Child ids start from one so these never clash.
+const unsigned long long RFD_WAKE=0, RFD_REAPER=1;
+
+struct c4s::process_reactor::child
+{
+    process *proc;
+    long long deadline;
+    unsigned long long id;
+    ostringstream out, err;
+    proc_done_fn done;
+    bool exited;    //!< Pidfd has signaled the exit.
+    int cancel_fd;  //!< Duplicate of the cancel token descriptor or -1. Epoll needs one per child.
+};
+
+// ==================================================================================================
+std::future<c4s::proc_result> c4s::process::start_async(std::chrono::milliseconds timeout)
+/*! Process is started in the calling thread and then handed to the process reactor. The calling thread
+  is free to do other work while the reactor collects the output and waits for the exit. Output is
+  captured into the result instead of the pipe target. If the timeout expires or the cancel token is
+  cancelled, the process is terminated and the future gives a process_exception. This object must not be
+  used before the future is ready.
+  \param timeout Time to wait.
+  \retval future Result of the run.
+*/
+{
+    std::shared_ptr<std::promise<proc_result>> prom = std::make_shared<std::promise<proc_result>>();
+    std::future<proc_result> fut = prom->get_future();
+    start();
+    if(!pid) {
+        // Dry run i.e. process::no_run
+        proc_result res;
+        res.rv = 0;
+        prom->set_value(res);
+        return fut;
+    }
+    process_reactor::instance().submit(this, timeout, [prom](proc_result *res, std::exception_ptr ep) {
+        if(ep)
+            prom->set_exception(ep);
+        else
+            prom->set_value(std::move(*res));
+    });
+    return fut;
+}
+
+// ==================================================================================================
+c4s::process_reactor& c4s::process_reactor::instance()
+{
+    static process_reactor reactor;
+    return reactor;
+}
+
+// ==================================================================================================
+c4s::process_reactor::process_reactor()
+{
+    quit = false;
+    next_id = 1;
+    count = 0;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    evfd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if(epfd == -1 || evfd == -1) {
+        ostringstream os;
+        os << "process_reactor - Unable to create epoll instance: "<<strerror(errno);
+        throw process_exception(os.str());
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = RFD_WAKE;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev);
+    // Reaper's epoll becomes readable when any started child exits.
+    int rfd = process::reaper_fd();
+    if(rfd>=0) {
+        ev.data.u64 = RFD_REAPER;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, rfd, &ev);
+    }
+    worker = std::thread(&process_reactor::run, this);
+}
+
+// ==================================================================================================
+c4s::process_reactor::~process_reactor()
+{
+    uint64_t one = 1;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    if(write(evfd, &one, sizeof(one)) == -1)
+        cerr << "process_reactor - Unable to wake the reactor thread.\n";
+    if(worker.joinable())
+        worker.join();
+    for(std::vector<child*>::iterator ci=incoming.begin(); ci!=incoming.end(); ci++) {
+        if((*ci)->cancel_fd >= 0)
+            close((*ci)->cancel_fd);
+        delete *ci;
+    }
+    for(std::unordered_map<unsigned long long, child*>::iterator ai=active.begin(); ai!=active.end(); ai++) {
+        if(ai->second->cancel_fd >= 0)
+            close(ai->second->cancel_fd);
+        delete ai->second;
+    }
+    close(epfd);
+    close(evfd);
+}
+
+// ==================================================================================================
+void c4s::process_reactor::submit(process *proc, std::chrono::milliseconds timeout, proc_done_fn done)
+/*! Function returns immediately. Done function is called from the reactor thread when the process has
+  exited, failed or timed out.
+  \param proc Started process.
+  \param timeout Time to wait.
+  \param done Function that receives the result.
+*/
+{
+    uint64_t one = 1;
+    child *ch = new child;
+    ch->proc = proc;
+    ch->deadline = process::now_ms() + timeout.count();
+    ch->done = done;
+    ch->exited = false;
+    ch->cancel_fd = proc->cancel ? fcntl(proc->cancel->get_fd(), F_DUPFD_CLOEXEC, 3) : -1;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        incoming.push_back(ch);
+        count++;
+    }
+    if(write(evfd, &one, sizeof(one)) == -1)
+        throw process_exception("process_reactor::submit - Unable to wake the reactor thread.");
+}
+
+// ==================================================================================================
+size_t c4s::process_reactor::size()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return count;
+}
+
+// ==================================================================================================
+void c4s::process_reactor::adopt(child *ch)
+/*! Registers the child's file descriptors into epoll. Descriptor kind and child id are stored in the
+  event data so that events of already finished children can be recognized and ignored.
+*/
+{
+    int fds[5];
+    proc_pipes *pp = ch->proc->pipes;
+    ch->id = next_id++;
+    active[ch->id] = ch;
+    fds[RFD_OUT] = pp ? pp->get_fd_out() : -1;
+    fds[RFD_ERR] = pp ? pp->get_fd_err() : -1;
+    fds[RFD_PID] = ch->proc->pidfd;
+    fds[RFD_IN] = pp ? pp->get_fd_in() : -1;
+    fds[RFD_CANCEL] = ch->cancel_fd;
+    for(unsigned long long kind=0; kind<5; kind++) {
+        if(fds[kind] < 0)
+            continue;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = kind==RFD_IN ? EPOLLOUT : EPOLLIN;
+        ev.data.u64 = (ch->id<<RFD_BITS)|kind;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[kind], &ev);
+    }
+}
+
+// ==================================================================================================
+void c4s::process_reactor::finish(child *ch, const char *failure)
+/*! Collects the remaining output, releases the process resources and passes the result to the done
+  function. Child is deleted.
+  \param failure If set, the process is terminated and the done function gets an exception with this text.
+*/
+{
+    process *proc = ch->proc;
+    proc_result res;
+    std::exception_ptr ep;
+    active.erase(ch->id);
+    if(ch->cancel_fd >= 0) {
+        // Cancel token is still open elsewhere, so closing the duplicate alone would not unregister it.
+        epoll_ctl(epfd, EPOLL_CTL_DEL, ch->cancel_fd, 0);
+        close(ch->cancel_fd);
+    }
+    try {
+        if(failure) {
+            proc->stop();
+            ostringstream os;
+            os << "process::start_async - name="<<proc->command.get_base()<<"; "<<failure;
+            throw process_exception(os.str());
+        }
+        proc->pipes->read_child_stdout(&ch->out);
+        proc->pipes->read_child_stderr(&ch->err);
+        proc->pid = 0;
+        proc->stop();
+        res.rv = proc->last_ret_val;
+        res.out = ch->out.str();
+        res.err = ch->err.str();
+    }catch(...) {
+        ep = std::current_exception();
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        count--;
+    }
+    try {
+        ch->done(ep ? 0 : &res, ep);
+    }catch(...) {
+        cerr << "process_reactor - Done function threw an exception.\n";
+    }
+    delete ch;
+}
+
+// ==================================================================================================
+void c4s::process_reactor::sweep(long long now)
+/*! Reaps the exited children and terminates the ones whose timeout has expired.
+ */
+{
+    std::vector<std::pair<child*,const char*>> ready;
+    for(std::unordered_map<unsigned long long, child*>::iterator ai=active.begin(); ai!=active.end(); ai++) {
+        child *ch = ai->second;
+        try {
+            ch->proc->check_halt();
+            if((ch->exited || ch->proc->pidfd<0) && ch->proc->reap())
+                ready.push_back(std::make_pair(ch, (const char*)0));
+            else if(now >= ch->deadline)
+                ready.push_back(std::make_pair(ch, "Process timeout!"));
+            else if(ch->proc->cancel && ch->proc->cancel->is_cancelled())
+                ready.push_back(std::make_pair(ch, "Process cancelled!"));
+        }catch(const process_exception &) {
+            // Reap failed. Finish reports the stop error, if any.
+            ready.push_back(std::make_pair(ch, "Process timeout!"));
+        }
+    }
+    for(size_t ndx=0; ndx<ready.size(); ndx++)
+        finish(ready[ndx].first, ready[ndx].second);
+}
+
+// ==================================================================================================
+void c4s::process_reactor::run()
+/*! Thread function. Waits for events from all children and the wake-up eventfd. Exits of children that
+  are not supervised by the reactor are collected into the reaper table.
+ */
+{
+    std::vector<struct epoll_event> events(64);
+    std::vector<child*> adopted;
+    uint64_t counter;
+
+    for(;;) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(quit)
+                break;
+            adopted.swap(incoming);
+        }
+        for(std::vector<child*>::iterator ci=adopted.begin(); ci!=adopted.end(); ci++)
+            adopt(*ci);
+        adopted.clear();
+
+        long long now = process::now_ms();
+        long long delay = -1;
+        for(std::unordered_map<unsigned long long, child*>::iterator ai=active.begin(); ai!=active.end(); ai++) {
+            long long left = ai->second->deadline - now;
+            if(ai->second->proc->pidfd<0 && left>PROC_POLL_TICK)
+                left = PROC_POLL_TICK;
+            if(delay<0 || left<delay)
+                delay = left>0 ? left : 0;
+        }
+        bool polling = process::reaper_polling();
+        if(polling && (delay<0 || delay>PROC_POLL_TICK))
+            delay = PROC_POLL_TICK;
+        int nfds = epoll_wait(epfd, &events[0], (int)events.size(), (int)delay);
+        if(nfds == -1) {
+            if(errno == EINTR)
+                continue;
+            cerr << "process_reactor - epoll error: "<<strerror(errno)<<'\n';
+            break;
+        }
+        bool reap = polling;
+        for(int ndx=0; ndx<nfds; ndx++) {
+            unsigned long long data = events[ndx].data.u64;
+            if(data == RFD_WAKE) {
+                if(read(evfd, &counter, sizeof(counter)) == -1 && errno != EAGAIN)
+                    cerr << "process_reactor - eventfd read error: "<<strerror(errno)<<'\n';
+                continue;
+            }
+            if(data == RFD_REAPER) {
+                reap = true;
+                continue;
+            }
+            std::unordered_map<unsigned long long, child*>::iterator ai = active.find(data>>RFD_BITS);
+            if(ai == active.end())
+                continue;
+            child *ch = ai->second;
+            proc_pipes *pp = ch->proc->pipes;
+            try {
+                switch(data & ((1<<RFD_BITS)-1)) {
+                case RFD_OUT:
+                    if(pp->get_fd_out() >= 0)
+                        pp->read_child_stdout(&ch->out);
+                    break;
+                case RFD_ERR:
+                    if(pp->get_fd_err() >= 0)
+                        pp->read_child_stderr(&ch->err);
+                    break;
+                case RFD_PID:
+                    ch->exited = true;
+                    break;
+                case RFD_CANCEL:
+                    // Sweep finishes the child.
+                    break;
+                case RFD_IN:
+                    if(pp->get_fd_in() < 0)
+                        break;
+                    if(events[ndx].events & (EPOLLERR|EPOLLHUP))
+                        pp->close_child_input();
+                    else
+                        pp->feed_child_input();
+                    break;
+                }
+            }catch(const process_exception &) {
+                // Read errors close the pipe. Exit is collected normally.
+            }
+        }
+        if(reap)
+            process::reap_all();
+        sweep(process::now_ms());
+    }
+}
+#endif
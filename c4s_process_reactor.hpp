@@ -0,0 +1,127 @@
+/*******************************************************************************
+c4s_process_reactor.hpp
+Defines process_reactor-class for Cpp4Scripts library.
+
+--------------------------------------------------------------------------------
+This file is part of Cpp4Scripts library.
+
+  Cpp4Scripts is free software: you can redistribute it and/or modify it under
+  the terms of the GNU Lesser General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option) any
+  later version.
+
+  Cpp4Scripts is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details:
+  http://www.gnu.org/licenses/lgpl.html
+
+Copyright (c) Menacon Ltd, Finland
+*******************************************************************************/
+#ifndef C4S_PROCESS_REACTOR_HPP
+#define C4S_PROCESS_REACTOR_HPP
+
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <thread>
+#if __cplusplus >= 202002L && defined(__has_include)
+ #if __has_include(<coroutine>)
+  #include <coroutine>
+  #define C4S_COROUTINES
+ #endif
+#endif
+
+namespace c4s {
+
+    //! Function that receives the result of an asynchronous run. Exception pointer is set on failure.
+    typedef std::function<void(proc_result *, std::exception_ptr)> proc_done_fn;
+
+    // ----------------------------------------------------------------------------------------------------
+    //! Supervises asynchronously started processes from a single background thread. (Linux)
+    /*! Reactor multiplexes the pipes and pidfds of all running children with epoll. Thread is started
+      when the first child is started. It also reaps every child that exits, so that children do not
+      remain zombies while their owners are busy. Processes are normally handed to the reactor with
+      process::start_async. Cancel token of the process is honored. Process object must not be used or
+      destroyed before its run has completed.
+    */
+    class process_reactor
+    {
+    public:
+        //! Returns the reactor. Reactor and its thread are created at the first call.
+        static process_reactor& instance();
+        //! Stops the thread. Children still running are abandoned.
+        ~process_reactor();
+
+        //! Supervises the already started process until it exits, the timeout expires or it is cancelled.
+        void submit(process *, std::chrono::milliseconds timeout, proc_done_fn done);
+        //! Returns the number of processes being supervised.
+        size_t size();
+
+    protected:
+        process_reactor();
+        struct child;
+        void run();
+        void adopt(child *);
+        void finish(child *, const char *failure);
+        void sweep(long long now);
+
+        int epfd;                   //!< Epoll instance for all children.
+        int evfd;                   //!< Eventfd that wakes the thread for new children and exit.
+        bool quit;                  //!< Set when the thread should exit.
+        unsigned long long next_id; //!< Identifier for the next adopted child.
+        std::mutex lock;            //!< Protects incoming, quit and count.
+        std::vector<child*> incoming; //!< Children submitted but not yet adopted by the thread.
+        std::unordered_map<unsigned long long, child*> active; //!< Children supervised by the thread.
+        size_t count;               //!< Number of submitted children not yet finished.
+        std::thread worker;
+    };
+
+#ifdef C4S_COROUTINES
+    // ----------------------------------------------------------------------------------------------------
+    //! Awaitable that runs the process with the reactor. (Linux, C++20)
+    /*! Coroutine is resumed in the reactor thread when the process has exited. Use async_exec to create.
+     */
+    class proc_awaiter
+    {
+    public:
+        proc_awaiter(process &p, std::chrono::milliseconds to) : proc(p), timeout(to) { }
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            try {
+                proc.start();
+            }catch(...) {
+                error = std::current_exception();
+                return false;
+            }
+            if(!proc.get_pid()) {
+                result.rv = 0;
+                return false;
+            }
+            process_reactor::instance().submit(&proc, timeout, [this,h](proc_result *res, std::exception_ptr ep) {
+                if(ep)
+                    error = ep;
+                else
+                    result = std::move(*res);
+                h.resume();
+            });
+            return true;
+        }
+        proc_result await_resume() {
+            if(error)
+                std::rethrow_exception(error);
+            return std::move(result);
+        }
+    protected:
+        process &proc;
+        std::chrono::milliseconds timeout;
+        proc_result result;
+        std::exception_ptr error;
+    };
+    //! Returns an awaitable for co_await that starts the process and completes when it has exited.
+    inline proc_awaiter async_exec(process &p, int timeout=C4S_PROC_TIMEOUT) { return proc_awaiter(p, std::chrono::seconds(timeout)); }
+    //! Returns an awaitable for co_await that starts the process and completes when it has exited.
+    inline proc_awaiter async_exec(process &p, std::chrono::milliseconds timeout) { return proc_awaiter(p, timeout); }
+#endif
+}
+#endif
@@ -37,7 +37,19 @@ Copyright (c) Menacon Ltd.
 #include "c4s_variables.hpp"
 #include "c4s_program_arguments.hpp"
 #include "c4s_compiled_file.hpp"
+#if defined(__linux) || defined(__APPLE__)
+  #include "c4s_capture.hpp"
+#endif
 #include "c4s_process.hpp"
+#if defined(__linux) || defined(__APPLE__)
+  #include "c4s_process_group.hpp"
+  #include "c4s_pipeline.hpp"
+  #include "c4s_process_cache.hpp"
+#endif
+#ifdef __linux
+  #include "c4s_process_reactor.hpp"
+  #include "c4s_fork_server.hpp"
+#endif
 #include "c4s_logger.hpp"
 #include "c4s_util.hpp"
 #include "c4s_settings.hpp"
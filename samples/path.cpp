@@ -262,12 +262,177 @@ void test13()
     for(path_iterator pi=cpp.begin(); pi!=cpp.end(); pi++)
         cout << pi->get_path() << '\n';
 }
+// ------------------------------------------------------------------------------------------
+long long file_size(const path &fp)
+{
+    ifstream fs(fp.get_path().c_str(), ios::binary|ios::ate);
+    return fs ? (long long)fs.tellg() : -1;
+}
+void test14()
+{
+    // Copy a 64 MB file, then append it to the copy.
+    path orig("bigfile.tmp");
+    path copy("bigfile-copy.tmp");
+    {
+        ofstream of(orig.get_path().c_str(), ios::binary);
+        string block(0x100000, 'x');
+        for(int i=0; i<64; i++) {
+            block[0] = 'a'+i%26;
+            of << block;
+        }
+    }
+    try {
+        chrono::steady_clock::time_point beg = chrono::steady_clock::now();
+        orig.cp(copy, PCF_FORCE);
+        cout << "Copied "<<file_size(copy)<<" bytes in "
+             << chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-beg).count()<<" us.\n";
+        orig.cp(copy, PCF_FORCE|PCF_APPEND);
+        cout << "After append: "<<file_size(copy)<<" bytes.\n";
+    }catch(const path_exception &pe) {
+        cout << "copy failed: "<<pe.what()<<'\n';
+    }
+    orig.rm();
+    copy.rm();
+}
+// ------------------------------------------------------------------------------------------
+void test15()
+{
+    // Copy a 1 GB sparse file that has 1 MB of data at the start, in the middle and at the end.
+    path orig("sparse.tmp");
+    path copy("sparse-copy.tmp");
+    {
+        ofstream of(orig.get_path().c_str(), ios::binary);
+        string block(0x100000, 's');
+        long long offsets[3] = { 0, 0x20000000, 0x40000000-0x100000 };
+        for(int i=0; i<3; i++) {
+            of.seekp(offsets[i]);
+            of << block;
+        }
+    }
+    try {
+        copy_stats cs;
+        orig.cp(copy, PCF_FORCE, &cs);
+        cout << "Copied "<<cs.files<<" file: "<<file_size(copy)<<" bytes, "<<cs.bytes<<" bytes of data, "
+             << cs.holes<<" bytes of holes, "<<cs.clones<<" clones.\n";
+#if defined(__linux) || defined(__APPLE__)
+        struct stat st;
+        if(stat(copy.get_path().c_str(), &st) == 0)
+            cout << "Target uses "<<st.st_blocks*512<<" bytes of disk.\n";
+#endif
+    }catch(const path_exception &pe) {
+        cout << "copy failed: "<<pe.what()<<'\n';
+    }
+    orig.rm();
+    copy.rm();
+}
+// ------------------------------------------------------------------------------------------
+void test16()
+{
+    // Copy the library source tree in parallel and remove the copy.
+    path source("../");
+    path target("c4stest-tree/");
+    copy_stats cs;
+    cs.progress = [](const copy_stats &p) {
+        cout << "  "<<p.files<<" files, "<<p.bytes<<" bytes so far.\n";
+    };
+    try {
+        source.cp(target, PCF_RECURSIVE|PCF_FORCE, &cs);
+        cout << "Copied "<<cs.files<<" files ("<<cs.hardlinks<<" hard links), "<<cs.symlinks<<" symbolic links and "
+             << cs.dirs<<" directories. "<<cs.bytes<<" bytes in "<<cs.seconds<<" s = "<<(long long)cs.rate()<<" B/s.\n";
+        target.rmdir(true);
+    }catch(const path_exception &pe) {
+        cout << "recursive copy failed: "<<pe.what()<<'\n';
+    }
+}
+// ------------------------------------------------------------------------------------------
+void make_tree(const path &root)
+{
+    // 100 directories with 200 files each and a chain of directories deeper than the path length limit.
+    root.mkdir();
+    for(int d=0; d<100; d++) {
+        ostringstream dn;
+        dn << root.get_dir() << "dir-" << d << '/';
+        path(dn.str()).mkdir();
+        for(int f=0; f<200; f++) {
+            ostringstream fn;
+            fn << dn.str() << "file-" << f << ".tmp";
+            ofstream of(fn.str().c_str());
+            of << fn.str() << '\n';
+        }
+    }
+#if defined(__linux) || defined(__APPLE__)
+    int fd = open(root.get_dir().c_str(), O_RDONLY|O_DIRECTORY);
+    for(int depth=0; fd>=0 && depth<300; depth++) {
+        const char *name = "a-rather-long-directory-name";
+        mkdirat(fd, name, 0777);
+        int sub = openat(fd, name, O_RDONLY|O_DIRECTORY);
+        close(fd);
+        fd = sub;
+    }
+    if(fd>=0)
+        close(fd);
+#endif
+}
+// ------------------------------------------------------------------------------------------
+void test17()
+{
+    // Delete a tree of 20000 files and a very deep directory chain, then the same in the background.
+    path target("c4stest-rm/");
+    try {
+        make_tree(target);
+        long long start = process::now_ms();
+        target.rmdir(true);
+        cout << "rmdir(true) took "<<process::now_ms()-start<<" ms. Directory "
+             << (target.dirname_exists() ? "still exists.\n" : "is gone.\n");
+        make_tree(target);
+        start = process::now_ms();
+        target.rmdir_async();
+        cout << "rmdir_async returned in "<<process::now_ms()-start<<" ms. Directory "
+             << (target.dirname_exists() ? "still exists.\n" : "is gone.\n");
+        path::rmdir_wait();
+        cout << "Background delete done in "<<process::now_ms()-start<<" ms.\n";
+    }catch(const path_exception &pe) {
+        cout << "rmdir failed: "<<pe.what()<<'\n';
+    }
+}
+// ------------------------------------------------------------------------------------------
+void test18()
+{
+    // Read the metadata once and compare files written within the same second.
+    path older("stat-older.tmp");
+    path newer("stat-newer.tmp");
+    {
+        ofstream of(older.get_path().c_str());
+        of << "older\n";
+    }
+    // File system timestamps advance in clock ticks, not in nanoseconds.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    {
+        ofstream of(newer.get_path().c_str());
+        of << "newer\n";
+    }
+    try {
+        const path_stat &ps = newer.get_stat();
+        cout << newer.get_path()<<": size "<<ps.size<<", mode "<<oct<<(ps.mode&07777)<<dec<<", uid "<<ps.uid
+             << ", inode "<<ps.ino<<", links "<<ps.nlink<<", mtime "<<ps.mtime<<" ns.\n";
+        cout << "exists: "<<newer.exists()<<", directory exists: "<<newer.dirname_exists()
+             << ", directory: "<<path("./").get_stat().is_dir()<<'\n';
+        cout << "Seconds: older "<<older.read_changetime()<<", newer "<<newer.read_changetime()<<'\n';
+        cout << "newer.compare_times(older) = "<<newer.compare_times(older)<<" (1 = newer).\n";
+        newer.rm();
+        cout << "After rm exists: "<<newer.exists()<<'\n';
+    }catch(const path_exception &pe) {
+        cout << "stat failed: "<<pe.what()<<'\n';
+    }
+    older.rm();
+    newer.rm();
+}
 // ==========================================================================================
 int main(int argc, char **argv)
 {
-    const int tmax = 13;
+    const int tmax = 18;
     tfptr tfunc[tmax] = { &test1, &test2, &test3, &test4, &test5, &test6, &test7, &test8, &test9,
-        &test10, &test11, &test12, &test13 };
+        &test10, &test11, &test12, &test13, &test14, &test15, &test16, &test17, &test18 };
 
     const char *title = "Cpp4Scripts - Path sample and test program";
     const char *info  = "Following tests have been defined:\n"\
@@ -283,7 +448,12 @@ int main(int argc, char **argv)
         "10 = Replace block.\n"\
         "11 = Replace block within custom tags.\n"\
         "12 = Path construction with const char* and const string&.\n"\
-        "13 = path_list: test exclude regex. (-s search regex; -e exclude regex).\n";
+        "13 = path_list: test exclude regex. (-s search regex; -e exclude regex).\n"\
+        "14 = cp: copy and append a 64 MB file.\n"\
+        "15 = cp: copy a 1 GB sparse file and show the copy statistics.\n"\
+        "16 = cp: parallel recursive copy of the library tree with progress.\n"\
+        "17 = rmdir: parallel recursive delete of a large and deep tree, then the same in the background.\n"\
+        "18 = get_stat: metadata and nanosecond time comparison of files written within one second.\n";
 
     args += argument("-t",  true, "Sets VALUE as the test to run.");
     args += argument("-s",  true, "Sets VALUE as the text to search.");
@@ -8,6 +8,7 @@ Copyright (c) Menacon Ltd
 *******************************************************************************/
 
 #include <string>
+#include <thread>
 using namespace std;
 #define C4S_DEBUGTRACE
 #include "../c4s_all.hpp"
@@ -147,11 +148,372 @@ void test9()
         cout <<"Failed: "<<pe.what()<<endl;
     }
 }
+// ..........................................................................................
+void test10()
+{
+#if defined(__linux) || defined(__APPLE__)
+    const int rounds = 500;
+    const char *names[] = { "fork", "spawn", "server" };
+    PROC_LAUNCH methods[] = { PROC_LAUNCH::FORK, PROC_LAUNCH::SPAWN, PROC_LAUNCH::SERVER };
+    int count = 2;
+#ifdef __linux
+    // Server is started while the process is still small.
+    fork_server::start();
+    count = 3;
+#endif
+    // Touch some memory so that the fork has page tables to copy.
+    string ballast(256*1024*1024, 'x');
+    for(int ndx=0; ndx<count; ndx++) {
+        process tp("true");
+        tp.set_launch(methods[ndx]);
+        struct timespec beg, end;
+        clock_gettime(CLOCK_MONOTONIC, &beg);
+        for(int i=0; i<rounds; i++)
+            tp();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec-beg.tv_sec)*1000.0 + (end.tv_nsec-beg.tv_nsec)/1000000.0;
+        cout << names[ndx] << ": "<<rounds<<" runs in "<<ms<<" ms ("<<ms/rounds<<" ms/run) with "
+             << ballast.size()/(1024*1024)<<" MB resident\n";
+    }
+#ifdef __linux
+    fork_server::stop();
+#endif
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test11()
+{
+#if defined(__linux) || defined(__APPLE__)
+    process_group group(&cout);
+    group.set_max_jobs(4);
+    for(int i=0; i<8; i++) {
+        ostringstream args;
+        // Later jobs finish first but the output is still in order.
+        args << "-c 'sleep 0."<<(8-i)<<"; echo job "<<i<<"; echo job "<<i<<" error >&2; exit "<<i%2<<"'";
+        group.add("sh", args.str());
+    }
+    int failed = group.run();
+    for(size_t ndx=0; ndx<group.size(); ndx++)
+        cout << "job "<<ndx<<" returned "<<group.get_return_value(ndx)<<'\n';
+    cout << failed << " jobs failed.\n";
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test12()
+{
+#if defined(__linux) || defined(__APPLE__)
+    // seq 1 200000 | grep 7 | sort -r | head -n 5 ; with tee after grep.
+    ostringstream matches;
+    pipeline pl(&cout);
+    pl.add("seq", "1 200000");
+    size_t grep = pl.add("grep", "7");
+    pl.add("sort", "-r -n");
+    pl.add("head", "-n 5");
+    pl.tee(grep, &matches);
+    pl(30);
+    string tee_out = matches.str();
+    cout << "grep matched "<<count(tee_out.begin(), tee_out.end(), '\n')<<" lines\n";
+    for(size_t ndx=0; ndx<pl.size(); ndx++)
+        cout << "stage "<<ndx<<" returned "<<pl.get_return_value(ndx)<<'\n';
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test13()
+{
+#if defined(__linux) || defined(__APPLE__)
+    // Same as: ls /usr/include/*.h | xargs -P 4 wc -l
+    path_list headers(path("/usr/include/"), "\\.h$");
+    process_group group;
+    group.set_max_jobs(4);
+    size_t batches = group.add_xargs("wc", vector<string>(1, "-l"), headers);
+    int failed = group.run();
+    cout << headers.size()<<" headers in "<<batches<<" batches, "<<failed<<" failed.\n";
+    // Force small batches to show the packing.
+    group.clear();
+    batches = group.add_xargs("wc", vector<string>(1, "-l"), headers, 50);
+    failed = group.run();
+    cout << "With 50 files per batch: "<<batches<<" batches, "<<failed<<" failed.\n";
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test14()
+{
+#ifdef __linux
+    // Start all processes at once and collect the results while the reactor waits for them.
+    const int count = 100;
+    vector<process> procs(count);
+    vector<future<proc_result>> results;
+    for(int i=0; i<count; i++) {
+        ostringstream args;
+        args << "-c 'sleep 0.5; echo "<<i<<"; exit "<<i%2<<"'";
+        procs[i].set_command("sh");
+        procs[i].set_args(args.str());
+        results.push_back(procs[i].start_async(10));
+    }
+    cout << process_reactor::instance().size()<<" processes running.\n";
+    int failed = 0;
+    for(int i=0; i<count; i++) {
+        proc_result res = results[i].get();
+        if(res.rv)
+            failed++;
+    }
+    cout << count<<" processes completed, "<<failed<<" returned non-zero.\n";
+#else
+    cout << "Sorry, this test is only for Linux\n";
+#endif
+}
+// ..........................................................................................
+void test15()
+{
+#if defined(__linux) || defined(__APPLE__)
+    // Keep 1MB in memory, rest goes to the spill file.
+    capture_buffer cb(0x100000);
+    process seq("seq", "1 5000000");
+    seq.capture_to(&cb);
+    seq();
+    cout << "Captured "<<cb.size()<<" bytes. Spilled: "<<(cb.spilled()?"yes":"no")<<'\n';
+    const char *data;
+    size_t len, lines=0;
+    while((len = cb.peek(&data)) > 0) {
+        lines += count(data, data+len, '\n');
+        cb.consume(len);
+    }
+    cout << lines<<" lines.\n";
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test16()
+{
+#if defined(__linux) || defined(__APPLE__)
+    // Stop the child as soon as an error line appears in stderr.
+    int lines = 0;
+    process mon("sh", "-c 'for i in 1 2 3 4 5 6 7 8 9; do echo step $i; [ $i = 4 ] && echo error: step $i failed >&2; sleep 0.2; done'");
+    mon.on_stdout([&lines](const char *, size_t) {
+        lines++;
+        return true;
+    });
+    mon.on_stderr([](const char *data, size_t len) {
+        string line(data, len);
+        cout << "stderr: "<<line<<'\n';
+        return line.compare(0, 6, "error:") != 0;
+    });
+    mon();
+    cout << lines<<" lines of output. Halted: "<<(mon.is_halted()?"yes":"no")<<'\n';
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test17()
+{
+#if defined(__linux) || defined(__APPLE__)
+    // Second run is restored from the cache in ./cache/ unless process.cpp has changed.
+    process_cache cache(path("cache/"));
+    cache.add_input(path("process.cpp"));
+    cache.add_output(path("process.lines"));
+    for(int i=0; i<2; i++) {
+        process wc("sh", "-c 'sleep 1; wc -l process.cpp > process.lines; cat process.lines'", &cout);
+        cache.exec(wc);
+        cout << "Run "<<i+1<<(cache.was_hit() ? " was restored from cache.\n" : " was executed.\n");
+    }
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test18()
+{
+#if defined(__linux) || defined(__APPLE__)
+    // Health-check style probe with a 300 ms budget.
+    chrono::steady_clock::time_point beg = chrono::steady_clock::now();
+    process probe("sleep", "2");
+    try {
+        probe(chrono::milliseconds(300));
+    }catch(const process_exception &pe) {
+        cout << pe.what()<<'\n';
+    }
+    probe.stop();
+    cout << "Probe gave up after "
+         << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-beg).count()<<" ms.\n";
+
+    // Cancel a group of slow jobs from another thread.
+    cancel_token token;
+    process_group group;
+    group.set_cancel(&token);
+    group.set_max_jobs(4);
+    for(int i=0; i<8; i++)
+        group.add("sleep", "5");
+    thread canceller([&token]() {
+        this_thread::sleep_for(chrono::milliseconds(500));
+        token.cancel();
+    });
+    beg = chrono::steady_clock::now();
+    int failed = group.run();
+    canceller.join();
+    cout << failed<<" jobs cancelled after "
+         << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-beg).count()<<" ms.\n";
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test19()
+{
+#if defined(__linux) || defined(__APPLE__)
+    // Services ignore SIGTERM and have a child of their own. Each group is killed after 500 ms grace.
+    const int count = 10;
+    vector<process*> services;
+    for(int i=0; i<count; i++) {
+        process *sp = new process("sh", "-c 'trap \"\" TERM; sleep 30 & sleep 30'");
+        sp->set_group(PROC_GROUP::GROUP);
+        sp->set_grace(chrono::milliseconds(500));
+        sp->start();
+        services.push_back(sp);
+    }
+    this_thread::sleep_for(chrono::milliseconds(100));
+    chrono::steady_clock::time_point beg = chrono::steady_clock::now();
+    process::stop_all(services);
+    cout << count<<" services stopped in "
+         << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now()-beg).count()<<" ms.\n";
+    for(int i=0; i<count; i++)
+        delete services[i];
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
+// ..........................................................................................
+void test20()
+{
+#ifdef __linux
+    // Batch jobs at low priority on CPU 0 with a small descriptor limit.
+    const char *report = "-c 'echo nice=$(nice) files=$(ulimit -n) cpus=$(grep Cpus_allowed_list /proc/self/status | cut -f2)'";
+    proc_controls pc;
+    pc.set_nice(10);
+    pc.set_ioprio(IO_CLASS::IDLE);
+    pc.add_cpu(0);
+    pc.set_rlimit(RLIMIT_NOFILE, 64);
+    process_group group(&cout);
+    group.set_controls(pc);
+    for(int i=0; i<4; i++)
+        group.add("sh", report);
+    group.run();
+
+    // Same controls through the fork server.
+    fork_server::start();
+    process single("sh", report, &cout);
+    single.set_controls(pc);
+    single();
+    fork_server::stop();
+#else
+    cout << "Sorry, this test is only for Linux\n";
+#endif
+}
+// ..........................................................................................
+#ifdef __linux
+int count_zombies()
+{
+    int zombies = 0;
+    DIR *proc = opendir("/proc");
+    struct dirent *de;
+    while(proc && (de = readdir(proc)) != 0) {
+        char name[300], state;
+        int ppid;
+        snprintf(name, sizeof(name), "/proc/%s/stat", de->d_name);
+        FILE *stat = fopen(name, "r");
+        if(!stat)
+            continue;
+        if(fscanf(stat, "%*d %*s %c %d", &state, &ppid) == 2 && state == 'Z' && ppid == getpid())
+            zombies++;
+        fclose(stat);
+    }
+    if(proc)
+        closedir(proc);
+    return zombies;
+}
+#endif
+void test21()
+{
+#ifdef __linux
+    // Start children without waiting for them. Reactor thread reaps the exited ones in the background.
+    const int count = 200;
+    vector<process*> children;
+    for(int i=0; i<count; i++) {
+        process *pr = new process(i%2 ? "true" : "false");
+        pr->start();
+        children.push_back(pr);
+    }
+    this_thread::sleep_for(chrono::milliseconds(200));
+    cout << "Zombies without waiting: "<<count_zombies()<<'\n';
+    int running = 0, failed = 0;
+    for(int i=0; i<count; i++) {
+        if(children[i]->last_return_value())
+            failed++;
+        if(children[i]->is_running())
+            running++;
+        delete children[i];
+    }
+    cout << failed<<" children returned failure, "<<running<<" still running.\n";
+#else
+    cout << "Sorry, this test is only for Linux\n";
+#endif
+}
+// ..........................................................................................
+void test22()
+{
+#ifdef __linux
+    // Read 200 MB of output with the default pipe and with a 1 MB pipe.
+    size_t sizes[2] = { 0, PROC_MAX_PIPE_SIZE };
+    for(int i=0; i<2; i++) {
+        process chatty("head", "-c 200000000 /dev/zero");
+        chatty.set_pipe_size(sizes[i]);
+        chatty();
+        const pipe_stats &st = chatty.get_stdout_stats();
+        cout << (i ? "1 MB pipe: " : "Default pipe: ");
+        st.dump(cout);
+    }
+#else
+    cout << "Sorry, this test is only for Linux\n";
+#endif
+}
+// ..........................................................................................
+void test23()
+{
+#if defined(__linux) || defined(__APPLE__)
+    // Feed 20 MB to a child that reads only the first 300000 bytes and exits.
+    path big("big-input.tmp");
+    {
+        ofstream of(big.get_path().c_str(), ios::binary);
+        string block(0x100000, 'i');
+        for(int i=0; i<20; i++)
+            of << block;
+    }
+    ostringstream os;
+    process reader("head", "-c 300000", &os);
+    reader.pipe_from(big);
+    int rv = reader();
+    cout << "head returned "<<rv<<" with "<<os.str().size()<<" bytes. Parent survived the closed input.\n";
+    big.rm();
+#else
+    cout << "Sorry, this test is only for Linux and OSX\n";
+#endif
+}
 // ------------------------------------------------------------------------------------------
 int main(int argc, char **argv)
 {
-    const int tmax = 9;
-    tfptr tfunc[tmax] = { &test1, &test2, &test3, &test4, &test5, &test6, &test7, &test8, &test9 };
+    const int tmax = 23;
+    tfptr tfunc[tmax] = { &test1, &test2, &test3, &test4, &test5, &test6, &test7, &test8, &test9, &test10,
+                          &test11, &test12, &test13, &test14, &test15, &test16, &test17, &test18, &test19,
+                          &test20, &test21, &test22, &test23 };
 
     const char *title = "Cpp4Scripts - Process sample and test program";
     const char *info = "Following tests have been defined:\n"               \
@@ -163,7 +525,21 @@ int main(int argc, char **argv)
         " 6 = Test the use of execa - running same process with varied arguments.\n" \
         " 7 = Test the use of process user (linux only)\n"              \
         " 8 = Test the input stream with client.\n"\
-        " 9 = Terminate process with pid file (-pf)\n";
+        " 9 = Terminate process with pid file (-pf)\n" \
+        "10 = Benchmark fork, spawn and fork server launch methods.\n" \
+        "11 = Run jobs in parallel with process group.\n" \
+        "12 = Run a four stage pipeline with tee.\n" \
+        "13 = Run wc over all headers in /usr/include in xargs style batches.\n" \
+        "14 = Run 100 processes asynchronously with the process reactor.\n" \
+        "15 = Capture large output into a capture buffer that spills to file.\n" \
+        "16 = Monitor output line by line and stop the child on error.\n" \
+        "17 = Run a command through the process cache.\n" \
+        "18 = Run a probe with millisecond timeout and cancel a process group.\n" \
+        "19 = Stop ten services that ignore SIGTERM with a 500 ms grace period.\n" \
+        "20 = Run batch jobs with nice, idle I/O class, CPU affinity and file limit.\n" \
+        "21 = Start 200 children without waiting and let the reactor reap them.\n" \
+        "22 = Read 200 MB of output through default and 1 MB pipes and show the counters.\n" \
+        "23 = Feed a 20 MB file to a child that exits after reading the first 300000 bytes.\n";
 
     args += argument("-t",  true, "Sets VALUE as the test to run.");
     args += argument("-l", false, "Append -l parameter to ls command in test 1.");